@@ -0,0 +1,148 @@
+#!/usr/bin/env python3
+"""
+Read throughput of NANDImageMount on a synthetic NAND image, calling read() the way FUSE would
+but without mounting anything.
+
+The image has a GPT and the usual partitions filled with random bytes (which decrypt just as well
+as real data). The extension has to be built in place first: python3 setup.py build_ext --inplace
+"""
+
+import os
+import random
+import sys
+import types
+from argparse import ArgumentParser
+from tempfile import TemporaryDirectory
+from threading import Thread
+from time import perf_counter
+from zlib import crc32
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.dirname(os.path.realpath(__file__))), 'switchfs'))
+
+# read() is called directly, so libfuse itself isn't needed
+try:
+    import fuse
+except Exception:
+    fuse = types.ModuleType('fuse')
+
+    class FuseOSError(OSError):
+        def __init__(self, errno):
+            super().__init__(errno, os.strerror(errno))
+
+    fuse.FUSE = None
+    fuse.FuseOSError = FuseOSError
+    fuse.Operations = object
+    fuse.fuse_get_context = lambda: (0, 0, 0)
+    sys.modules['fuse'] = fuse
+
+
+def make_image(path: str, sizes: dict):
+    # partition name: size in bytes, starting after the GPT at lba 0x22 like a real one
+    entries = b''
+    lba = 0x22
+    for name, size in sizes.items():
+        sectors = size // 0x200
+        entries += (bytes(0x20) + (lba).to_bytes(8, 'little') + (lba + sectors - 1).to_bytes(8, 'little')
+                    + bytes(8) + name.encode('utf-16le')).ljust(0x80, b'\0')
+        lba += sectors
+    entries = entries.ljust(0x80 * 128, b'\0')
+
+    header = bytearray(b'EFI PART'.ljust(0x5C, b'\0'))
+    header[0x48:0x50] = (2).to_bytes(8, 'little')
+    header[0x50:0x54] = (128).to_bytes(4, 'little')
+    header[0x54:0x58] = (0x80).to_bytes(4, 'little')
+    header[0x58:0x5C] = crc32(entries).to_bytes(4, 'little')
+    header[0x10:0x14] = crc32(header).to_bytes(4, 'little')
+
+    with open(path, 'wb') as f:
+        f.write(bytes(0x200) + bytes(header).ljust(0x200, b'\0') + entries)
+        f.truncate(0x22 * 0x200)
+        f.seek(0x22 * 0x200)
+        remaining = (lba - 0x22) * 0x200
+        chunk = os.urandom(0x100000)
+        while remaining:
+            remaining -= f.write(chunk[:min(remaining, len(chunk))])
+
+
+def run_readers(mount, path: str, offsets: list, size: int, threads: int, fh: int) -> float:
+    def reader(part):
+        # every thread gets its own handle, like separate open()s through FUSE
+        handle = mount.open(path, os.O_RDONLY) if fh else 0
+        for offset in part:
+            mount.read(path, size, offset, handle)
+        if handle:
+            mount.release(path, handle)
+
+    parts = [offsets[i::threads] for i in range(threads)]
+    start = perf_counter()
+    workers = [Thread(target=reader, args=(p,)) for p in parts]
+    for w in workers:
+        w.start()
+    for w in workers:
+        w.join()
+    return perf_counter() - start
+
+
+def main():
+    parser = ArgumentParser(description='Benchmark NANDImageMount.read on a synthetic image.')
+    parser.add_argument('--size', type=int, metavar='MIB', default=256, help='USER partition size (default 256)')
+    parser.add_argument('--read-size', type=int, metavar='KIB', default=128,
+                        help='bytes per read, FUSE uses up to 128 (default 128)')
+    parser.add_argument('--threads', type=int, default=1, help='concurrent readers (default 1)')
+    parser.add_argument('--cache', type=int, metavar='MIB', default=32, help='decrypted sector cache (default 32)')
+    parser.add_argument('--readahead', type=int, metavar='KIB', default=1024, help='read-ahead window (default 1024)')
+    parser.add_argument('--write-buffer', type=int, metavar='MIB', default=4, help='write-back buffer (default 4)')
+    parser.add_argument('--no-mmap', action='store_true', help='read with io_uring or pread instead of a mapping')
+    parser.add_argument('--io', choices=('auto', 'io_uring', 'pread'), default='auto',
+                        help='how to read with --no-mmap (default auto)')
+    parser.add_argument('--dir', help='where to put the image (default: a temporary directory)')
+    a = parser.parse_args()
+
+    from mount.nand import NANDImageMount
+
+    size = a.size * 1024 * 1024
+    read_size = a.read_size * 1024
+    keys = ''.join(f'bis_key_{i:02d} = {os.urandom(32).hex()}\n' for i in range(4))
+    rnd = random.Random(0)
+
+    with TemporaryDirectory(dir=a.dir) as tmp:
+        image = os.path.join(tmp, 'nand.bin')
+        make_image(image, {'PRODINFO': 0x400000, 'SAFE': 0x400000, 'SYSTEM': 0x1000000, 'USER': size})
+        print(f'image {os.path.getsize(image) / 1024 / 1024:.0f} MiB, reads of {read_size:#x} bytes, '
+              f'{a.threads} thread(s)')
+
+        def mount():
+            f = open(image, 'rb')
+            m = NANDImageMount(nand_fp=f, g_stat=os.stat(image), keys=keys, readonly=True,
+                               cache_size=a.cache * 1024 * 1024, readahead_size=a.readahead * 1024,
+                               use_mmap=not a.no_mmap, writeback_size=a.write_buffer * 1024 * 1024,
+                               io_engine=a.io)
+            return m
+
+        sequential = list(range(0, size - read_size + 1, read_size))
+        aligned = [rnd.randrange(0, size // 0x1000) * 0x1000 for _ in range(20000)]
+        unaligned = [rnd.randrange(0, size - read_size) for _ in range(5000)]
+        cases = [
+            # name, offsets, read size, use a file handle (read-ahead follows handles)
+            ('sequential', sequential, read_size, True),
+            ('sequential, no handle', sequential, read_size, False),
+            ('random 4 KiB', aligned, 0x1000, True),
+            ('random unaligned', unaligned, read_size, True),
+        ]
+        # an area half the cache size, read once before timing
+        hot_area = min(size, a.cache * 1024 * 1024 // 2)
+        if hot_area > read_size:
+            cases.append(('random in cache', [rnd.randrange(0, hot_area - read_size) for _ in range(5000)],
+                          read_size, True))
+        print(f'{"":24} {"MB/s":>9} {"reads/s":>9}')
+        for name, offsets, rsize, fh in cases:
+            m = mount()
+            if name == 'random in cache':
+                run_readers(m, '/user.img', list(range(0, hot_area - read_size, read_size)), read_size, 1, 0)
+            secs = run_readers(m, '/user.img', offsets, rsize, a.threads, fh)
+            print(f'{name:24} {len(offsets) * rsize / secs / 1e6:9.1f} {len(offsets) / secs:9.0f}')
+            m.destroy('/')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,201 @@
+/*
+ * Throughput of the AES-XTSN code, linked straight against the xtsn_core library.
+ *
+ * First the block kernels of every backend this build and CPU have, on one 0x4000 sector's worth of
+ * blocks with precomputed tweaks. Then whole xtsn_decrypt/xtsn_encrypt calls through the backend
+ * xtsn_init picked (or the ones from --backend), over buffer sizes, sector sizes and skipped bytes.
+ *
+ * Build and run with "python3 setup.py bench", arguments go in --args.
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+extern "C" {
+#include "aes.h"
+#include "aes_ct.h"
+#include "aesni.h"
+#include "armv8.h"
+#include "vaes.h"
+#include "xtsn_core.h"
+}
+
+#if defined __x86_64__ || defined _M_X64 || defined __i386__ || defined _M_IX86
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define HAVE_TSC 1
+#endif
+
+typedef uint8_t u8;
+typedef uint64_t u64;
+
+static double min_time = 0.2;
+
+//reference cycles on x86, which tick at the base clock whatever the core clock does
+static inline u64 cycles() {
+    #ifdef HAVE_TSC
+    return __rdtsc();
+    #else
+    return 0;
+    #endif
+}
+
+struct Result {
+    double mbps;
+    double cpb; //cycles per byte, 0 when there's no counter
+};
+
+//runs f until min_time has passed, doubling the iterations each round so the clock is read rarely
+template<class F>
+static Result measure(u64 bytes, F f) {
+    u64 iters = 1;
+    f(); //warm up, and the first call may set things up
+    for(;;) {
+        auto start = std::chrono::steady_clock::now();
+        u64 c = cycles();
+        for (u64 i = 0; i < iters; i++) f();
+        c = cycles() - c;
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if(secs >= min_time) {
+            Result r;
+            r.mbps = (double)(bytes * iters) / secs / 1e6;
+            r.cpb = (double)c / (double)(bytes * iters);
+            return r;
+        }
+        iters *= secs > 0 && min_time / secs < 16 ? 2 : 16;
+    }
+}
+
+static void print_result(const char *what, Result dec, Result enc) {
+    if(dec.cpb > 0)
+        printf("%-34s %9.1f MB/s %7.2f c/B %9.1f MB/s %7.2f c/B\n", what, dec.mbps, dec.cpb, enc.mbps, enc.cpb);
+    else
+        printf("%-34s %9.1f MB/s %9s %9.1f MB/s\n", what, dec.mbps, "", enc.mbps);
+}
+
+typedef void (*kernel)(const u8*, u8*, const u8*, size_t);
+
+static void bench_kernel(const char *name, kernel dec, const u8 *dec_keys, kernel enc, const u8 *enc_keys) {
+    static u8 data[0x4000], tweaks[0x4000];
+    Result d = measure(sizeof(data), [&] {dec(dec_keys, data, tweaks, sizeof(data) / 16);});
+    Result e = measure(sizeof(data), [&] {enc(enc_keys, data, tweaks, sizeof(data) / 16);});
+    print_result(name, d, e);
+}
+
+//the bitsliced kernels take their packed keys, passed through the same pointer
+static void ct_decrypt(const u8 *sk, u8 *data, const u8 *tweaks, size_t blocks) {
+    aes_ct_xts_decrypt_128_blocks((const uint64_t*)sk, data, tweaks, blocks);
+}
+
+static void ct_encrypt(const u8 *sk, u8 *data, const u8 *tweaks, size_t blocks) {
+    aes_ct_xts_encrypt_128_blocks((const uint64_t*)sk, data, tweaks, blocks);
+}
+
+static void bench_kernels() {
+    u8 key[16] = {0}, roundkeys[176], dec_roundkeys[176];
+    uint64_t ct_roundkeys[AES_CT_ROUNDKEY_WORDS];
+    aes_key_schedule_128(key, roundkeys);
+    aes_decrypt_key_schedule_128(roundkeys, dec_roundkeys);
+    aes_ct_pack_roundkeys_128(roundkeys, ct_roundkeys);
+
+    printf("block kernels, 0x4000 bytes per call %20s %22s\n", "decrypt", "encrypt");
+    bench_kernel("portable", aes_ttable_xts_decrypt_128_blocks, dec_roundkeys,
+                 aes_ttable_xts_encrypt_128_blocks, roundkeys);
+    bench_kernel("constant-time", ct_decrypt, (const u8*)ct_roundkeys, ct_encrypt, (const u8*)ct_roundkeys);
+    #ifdef AESNI_BUILD
+    if(aesni_supported())
+        bench_kernel("aes-ni", aesni_xts_decrypt_128_blocks, dec_roundkeys,
+                     aesni_xts_encrypt_128_blocks, roundkeys);
+    #endif
+    #ifdef VAES_BUILD
+    if(vaes_supported())
+        bench_kernel("vaes", vaes_xts_decrypt_128_blocks, dec_roundkeys,
+                     vaes_xts_encrypt_128_blocks, roundkeys);
+    #endif
+    #ifdef ARMV8_AES_BUILD
+    if(armv8_aes_supported())
+        bench_kernel("armv8", armv8_xts_decrypt_128_blocks, dec_roundkeys,
+                     armv8_xts_encrypt_128_blocks, roundkeys);
+    #endif
+}
+
+static void bench_xtsn(const char *backend, size_t max_size, int threads) {
+    static const size_t sizes[] = {16, 0x200, 0x1000, 0x4000, 0x10000, 0x100000, 0x1000000, 0x4000000};
+    static const u64 sector_sizes[] = {0x200, 0x4000};
+    u8 key[16] = {1}, tweak[16] = {2};
+    xtsn_ctx *ctx;
+    int err;
+    if((err = xtsn_new(key, tweak, &ctx))) {
+        fprintf(stderr, "xtsn_new: %s\n", xtsn_strerror(err));
+        exit(1);
+    }
+    if(backend && (err = xtsn_ctx_set_backend(ctx, backend))) {
+        fprintf(stderr, "backend %s: %s\n", backend, xtsn_strerror(err));
+        xtsn_free(ctx);
+        return;
+    }
+    std::vector<u8> buf(max_size);
+
+    printf("\nxtsn_decrypt/xtsn_encrypt, backend %s, threads %d\n", xtsn_ctx_backend(ctx), threads);
+    for (u64 ss : sector_sizes) {
+        //from the start of a sector, halfway into one, and the last block of one
+        u64 skips[] = {0, ss / 2, ss - 16};
+        for (u64 skip : skips) {
+            for (size_t size : sizes) {
+                if(size > max_size) break;
+                char what[64];
+                snprintf(what, sizeof(what), "ss 0x%llx skip 0x%llx size 0x%llx",
+                         (unsigned long long)ss, (unsigned long long)skip, (unsigned long long)size);
+                Result d = measure(size, [&] {
+                    err |= xtsn_decrypt(ctx, buf.data(), NULL, size, 0, 0, ss, skip, threads);
+                });
+                Result e = measure(size, [&] {
+                    err |= xtsn_encrypt(ctx, buf.data(), NULL, size, 0, 0, ss, skip, threads);
+                });
+                print_result(what, d, e);
+            }
+        }
+    }
+    if(err) fprintf(stderr, "error: %s\n", xtsn_strerror(err));
+    xtsn_free(ctx);
+}
+
+int main(int argc, char **argv) {
+    size_t max_size = 0x4000000;
+    int threads = 1;
+    bool kernels = true;
+    const char *backend = NULL;
+    for (int i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "--max-size") && i + 1 < argc) max_size = strtoull(argv[++i], NULL, 0);
+        else if(!strcmp(argv[i], "--min-time") && i + 1 < argc) min_time = atof(argv[++i]);
+        else if(!strcmp(argv[i], "--threads") && i + 1 < argc) threads = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--backend") && i + 1 < argc) backend = argv[++i];
+        else if(!strcmp(argv[i], "--constant-time")) xtsn_set_constant_time(1);
+        else if(!strcmp(argv[i], "--no-kernels")) kernels = false;
+        else {
+            fprintf(stderr, "usage: %s [--max-size BYTES] [--min-time SECONDS] [--threads N] "
+                            "[--backend NAME|all] [--constant-time] [--no-kernels]\n", argv[0]);
+            return 2;
+        }
+    }
+    xtsn_init();
+    #ifdef HAVE_TSC
+    printf("c/B is in TSC ticks per byte\n\n");
+    #endif
+    if(kernels) bench_kernels();
+    if(backend && !strcmp(backend, "all")) {
+        xtsn_backend_info info[16];
+        int count = xtsn_backends(info, 16);
+        for (int i = 0; i < count && i < 16; i++) {
+            if(info[i].available) bench_xtsn(info[i].name, max_size, threads);
+        }
+    } else {
+        bench_xtsn(backend, max_size, threads);
+    }
+    return 0;
+}
@@ -1,12 +1,56 @@
 #!/usr/bin/env python3
 
+import os
+import shlex
+import subprocess
 import sys
 
-from setuptools import setup, Extension
+from setuptools import setup, Command, Extension
+from setuptools.command.build_ext import build_ext
 
 if sys.hexversion < 0x030601f0:
     sys.exit('Python 3.6.1+ is required.')
 
+cflags = ['/Ox' if sys.platform == 'win32' else '-O3', '' if sys.platform == 'win32' else '-std=c++11']
+# the core library loads OpenSSL with dlopen and runs worker threads
+system_libraries = [] if sys.platform == 'win32' else ['dl', 'pthread']
+
+
+# the extension links the core library, so build it first even when only build_ext is run
+class build_ext_core(build_ext):
+    def run(self):
+        self.run_command('build_clib')
+        super().run()
+
+
+# builds bench/xtsn_bench.cpp against the core library and runs it
+class bench(Command):
+    description = 'build and run the native AES-XTSN benchmark'
+    user_options = [('args=', None, 'arguments for the benchmark, run with --args=--help to list them')]
+
+    def initialize_options(self):
+        self.args = ''
+
+    def finalize_options(self):
+        pass
+
+    def run(self):
+        from distutils.ccompiler import new_compiler
+        from distutils.sysconfig import customize_compiler
+
+        self.run_command('build_clib')
+        clib = self.get_finalized_command('build_clib')
+        compiler = new_compiler()
+        customize_compiler(compiler)
+        objects = compiler.compile(['bench/xtsn_bench.cpp'], output_dir=clib.build_temp,
+                                   include_dirs=['switchfs'], extra_postargs=cflags)
+        libraries = ['xtsn_core'] + system_libraries
+        compiler.link_executable(objects, 'xtsn_bench', output_dir=clib.build_temp, libraries=libraries,
+                                 library_dirs=[clib.build_clib], target_lang='c++')
+        subprocess.check_call([os.path.join(clib.build_temp, compiler.executable_filename('xtsn_bench'))]
+                              + shlex.split(self.args))
+
+
 with open('README.md', 'r', encoding='utf-8') as f:
     readme = f.read()
 
@@ -25,7 +69,11 @@ setup(
         'Programming Language :: Python :: 3',
         'Programming Language :: Python :: 3.6',
     ],
-    ext_modules=[Extension('switchfs.ccrypto', sources=['switchfs/ccrypto.cpp', 'switchfs/aes.cpp'],
-                           extra_compile_args=['/Ox' if sys.platform == 'win32' else '-O3',
-                           '' if sys.platform == 'win32' else '-std=c++11'])]
+    libraries=[('xtsn_core', {'sources': ['switchfs/xtsn_core.cpp', 'switchfs/aes.cpp', 'switchfs/aes_ct.cpp',
+                                          'switchfs/aesni.cpp', 'switchfs/vaes.cpp', 'switchfs/armv8.cpp',
+                                          'switchfs/image_io.cpp'],
+                              'cflags': cflags})],
+    ext_modules=[Extension('switchfs.ccrypto', sources=['switchfs/ccrypto.cpp'],
+                           libraries=system_libraries, extra_compile_args=cflags)],
+    cmdclass={'build_ext': build_ext_core, 'bench': bench}
 )
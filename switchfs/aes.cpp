@@ -295,4 +295,169 @@ void aes_decrypt_128(const uint8_t *roundkeys, const uint8_t *ciphertext, uint8_
     }
 
 }
+
+/*
+ * T-tables: SubBytes and MixColumns (or their inverses) of one byte in one row, as the column
+ * it adds up to. Columns are little-endian words with row 0 in the low byte, so the table
+ * for row r is the one for row 0 rotated left by r bytes. Filled in from the sboxes at load.
+ */
+static uint32_t TE[4][256];
+static uint32_t TD[4][256];
+
+static inline uint32_t rotl8(uint32_t w) {
+    return (w << 8) | (w >> 24);
+}
+
+static inline uint32_t load32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void store32(uint8_t *p, uint32_t w) {
+    p[0] = (uint8_t)w; p[1] = (uint8_t)(w >> 8); p[2] = (uint8_t)(w >> 16); p[3] = (uint8_t)(w >> 24);
+}
+
+static void aes_tables_init(void) {
+    int x, r;
+    for (x = 0; x < 256; ++x) {
+        uint8_t s = SBOX[x], s2 = mul2(s);
+        uint8_t i = INV_SBOX[x], i2 = mul2(i), i4 = mul2(i2), i8 = mul2(i4);
+        // column [02 01 01 03] and [0e 09 0d 0b]
+        TE[0][x] = (uint32_t)s2 | ((uint32_t)s << 8) | ((uint32_t)s << 16) | ((uint32_t)(s2 ^ s) << 24);
+        TD[0][x] = (uint32_t)(i8 ^ i4 ^ i2) | ((uint32_t)(i8 ^ i) << 8) | ((uint32_t)(i8 ^ i4 ^ i) << 16) |
+                   ((uint32_t)(i8 ^ i2 ^ i) << 24);
+        for (r = 1; r < 4; ++r) {
+            TE[r][x] = rotl8(TE[r-1][x]);
+            TD[r][x] = rotl8(TD[r-1][x]);
+        }
+    }
+}
+
+// one round, out column j takes row r from in column j + r (or j - r for the inverse)
+#define TT_ROUND(T, o, s, a, b, c, d, rk) \
+    o = T[0][s[a] & 0xff] ^ T[1][(s[b] >> 8) & 0xff] ^ T[2][(s[c] >> 16) & 0xff] ^ T[3][s[d] >> 24] ^ load32(rk)
+#define TT_LAST(SB, s, a, b, c, d, rk) \
+    (((uint32_t)SB[s[a] & 0xff] | ((uint32_t)SB[(s[b] >> 8) & 0xff] << 8) | \
+     ((uint32_t)SB[(s[c] >> 16) & 0xff] << 16) | ((uint32_t)SB[s[d] >> 24] << 24)) ^ load32(rk))
+
+// s already has the first round key added
+static inline void tt_encrypt(const uint8_t *roundkeys, uint32_t *s) {
+    uint32_t t[4];
+    int j;
+    for (j = 1; j < AES_ROUNDS; ++j) {
+        roundkeys += 16;
+        TT_ROUND(TE, t[0], s, 0, 1, 2, 3, roundkeys);
+        TT_ROUND(TE, t[1], s, 1, 2, 3, 0, roundkeys + 4);
+        TT_ROUND(TE, t[2], s, 2, 3, 0, 1, roundkeys + 8);
+        TT_ROUND(TE, t[3], s, 3, 0, 1, 2, roundkeys + 12);
+        s[0] = t[0]; s[1] = t[1]; s[2] = t[2]; s[3] = t[3];
+    }
+    roundkeys += 16;
+    t[0] = TT_LAST(SBOX, s, 0, 1, 2, 3, roundkeys);
+    t[1] = TT_LAST(SBOX, s, 1, 2, 3, 0, roundkeys + 4);
+    t[2] = TT_LAST(SBOX, s, 2, 3, 0, 1, roundkeys + 8);
+    t[3] = TT_LAST(SBOX, s, 3, 0, 1, 2, roundkeys + 12);
+    s[0] = t[0]; s[1] = t[1]; s[2] = t[2]; s[3] = t[3];
+}
+
+static inline void tt_decrypt(const uint8_t *dec_roundkeys, uint32_t *s) {
+    uint32_t t[4];
+    int j;
+    for (j = 1; j < AES_ROUNDS; ++j) {
+        dec_roundkeys += 16;
+        TT_ROUND(TD, t[0], s, 0, 3, 2, 1, dec_roundkeys);
+        TT_ROUND(TD, t[1], s, 1, 0, 3, 2, dec_roundkeys + 4);
+        TT_ROUND(TD, t[2], s, 2, 1, 0, 3, dec_roundkeys + 8);
+        TT_ROUND(TD, t[3], s, 3, 2, 1, 0, dec_roundkeys + 12);
+        s[0] = t[0]; s[1] = t[1]; s[2] = t[2]; s[3] = t[3];
+    }
+    dec_roundkeys += 16;
+    t[0] = TT_LAST(INV_SBOX, s, 0, 3, 2, 1, dec_roundkeys);
+    t[1] = TT_LAST(INV_SBOX, s, 1, 0, 3, 2, dec_roundkeys + 4);
+    t[2] = TT_LAST(INV_SBOX, s, 2, 1, 0, 3, dec_roundkeys + 8);
+    t[3] = TT_LAST(INV_SBOX, s, 3, 2, 1, 0, dec_roundkeys + 12);
+    s[0] = t[0]; s[1] = t[1]; s[2] = t[2]; s[3] = t[3];
+}
+
+// mul2 without the branch, for key bytes
+static inline uint8_t mul2_ct(uint8_t a) {
+    return (uint8_t)((a << 1) ^ (0x1b & (0 - (a >> 7))));
+}
+
+void aes_decrypt_key_schedule_128(const uint8_t *roundkeys, uint8_t *dec_roundkeys) {
+    int i, j, r;
+    for (i = 0; i < 16; ++i) {
+        dec_roundkeys[i] = roundkeys[160 + i];
+        dec_roundkeys[160 + i] = roundkeys[i];
+    }
+    // InvMixColumns worked out rather than looked up, a table indexed by key bytes would leak them through
+    // the cache: [0e 0b 0d 09] is 8 * (a0 ^ a1 ^ a2 ^ a3) ^ 4 * (a0 ^ a2) ^ 2 * (a0 ^ a1) ^ a1 ^ a2 ^ a3
+    for (i = 1; i < AES_ROUNDS; ++i) {
+        for (j = 0; j < 16; j += 4) {
+            const uint8_t *k = roundkeys + (AES_ROUNDS - i) * 16 + j;
+            for (r = 0; r < 4; ++r) {
+                uint8_t a0 = k[r], a1 = k[(r + 1) & 3], a2 = k[(r + 2) & 3], a3 = k[(r + 3) & 3];
+                uint8_t all = a0 ^ a1 ^ a2 ^ a3;
+                dec_roundkeys[i * 16 + j + r] = mul2_ct(mul2_ct(mul2_ct(all))) ^ mul2_ct(mul2_ct(a0 ^ a2)) ^
+                                                mul2_ct(a0 ^ a1) ^ all ^ a0;
+            }
+        }
+    }
+}
+
+void aes_ttable_encrypt_128(const uint8_t *roundkeys, const uint8_t *plaintext, uint8_t *ciphertext) {
+    uint32_t s[4];
+    int i;
+    for (i = 0; i < 4; ++i) {
+        s[i] = load32(plaintext + i * 4) ^ load32(roundkeys + i * 4);
+    }
+    tt_encrypt(roundkeys, s);
+    for (i = 0; i < 4; ++i) {
+        store32(ciphertext + i * 4, s[i]);
+    }
+}
+
+void aes_ttable_decrypt_128(const uint8_t *dec_roundkeys, const uint8_t *ciphertext, uint8_t *plaintext) {
+    uint32_t s[4];
+    int i;
+    for (i = 0; i < 4; ++i) {
+        s[i] = load32(ciphertext + i * 4) ^ load32(dec_roundkeys + i * 4);
+    }
+    tt_decrypt(dec_roundkeys, s);
+    for (i = 0; i < 4; ++i) {
+        store32(plaintext + i * 4, s[i]);
+    }
+}
+
+void aes_ttable_xts_encrypt_128_blocks(const uint8_t *roundkeys, uint8_t *data, const uint8_t *tweaks, size_t blocks) {
+    uint32_t s[4];
+    int i;
+    for (; blocks; --blocks, data += 16, tweaks += 16) {
+        for (i = 0; i < 4; ++i) {
+            s[i] = load32(data + i * 4) ^ load32(tweaks + i * 4) ^ load32(roundkeys + i * 4);
+        }
+        tt_encrypt(roundkeys, s);
+        for (i = 0; i < 4; ++i) {
+            store32(data + i * 4, s[i] ^ load32(tweaks + i * 4));
+        }
+    }
+}
+
+void aes_ttable_xts_decrypt_128_blocks(const uint8_t *dec_roundkeys, uint8_t *data, const uint8_t *tweaks, size_t blocks) {
+    uint32_t s[4];
+    int i;
+    for (; blocks; --blocks, data += 16, tweaks += 16) {
+        for (i = 0; i < 4; ++i) {
+            s[i] = load32(data + i * 4) ^ load32(tweaks + i * 4) ^ load32(dec_roundkeys + i * 4);
+        }
+        tt_decrypt(dec_roundkeys, s);
+        for (i = 0; i < 4; ++i) {
+            store32(data + i * 4, s[i] ^ load32(tweaks + i * 4));
+        }
+    }
+}
 } //extern
+
+// the tables are ready before anything in the extension can use them
+static struct AESTablesInit {
+    AESTablesInit() {aes_tables_init();}
+} aes_tables_init_at_load;
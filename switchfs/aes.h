@@ -13,6 +13,7 @@
 #ifndef AES_128_H
 #define AES_128_H
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdint.h>
 
@@ -45,4 +46,55 @@ void aes_encrypt_128(const uint8_t *roundkeys, const uint8_t *plaintext, uint8_t
  */
 void aes_decrypt_128(const uint8_t *roundkeys, const uint8_t *ciphertext, uint8_t *plaintext);
 
+/*
+ * The same cipher through 32-bit lookup tables, SubBytes, ShiftRows and MixColumns done as
+ * four lookups per column. Decryption uses the equivalent inverse cipher, with its own round keys.
+ */
+
+/**
+ * @purpose:                Derive the equivalent inverse cipher round keys (InvMixColumns applied to
+ *                          the middle ones, in the order they are used). No table lookups, so it's
+ *                          safe for the constant-time and hardware backends
+ * @par[in]roundkeys:       176 bytes of round keys from aes_key_schedule_128
+ * @par[out]dec_roundkeys:  176 bytes of decryption round keys
+ */
+void aes_decrypt_key_schedule_128(const uint8_t *roundkeys, uint8_t *dec_roundkeys);
+
+/**
+ * @purpose:            Table driven encryption of one block (16 bytes).
+ *                      The plaintext and ciphertext may point to the same memory
+ * @par[in]roundkeys:   round keys from aes_key_schedule_128
+ * @par[in]plaintext:   plain text
+ * @par[out]ciphertext: cipher text
+ */
+void aes_ttable_encrypt_128(const uint8_t *roundkeys, const uint8_t *plaintext, uint8_t *ciphertext);
+
+/**
+ * @purpose:                Table driven decryption of one block (16 bytes).
+ *                          The ciphertext and plaintext may point to the same memory
+ * @par[in]dec_roundkeys:   round keys from aes_decrypt_key_schedule_128
+ * @par[in]ciphertext:      cipher text
+ * @par[out]plaintext:      plain text
+ */
+void aes_ttable_decrypt_128(const uint8_t *dec_roundkeys, const uint8_t *ciphertext, uint8_t *plaintext);
+
+/**
+ * @purpose:            In-place XTS style encryption of many consecutive blocks:
+ *                      each block is xored with its tweak, encrypted and xored again
+ * @par[in]roundkeys:   round keys from aes_key_schedule_128
+ * @par[in,out]data:    blocks * 16 bytes
+ * @par[in]tweaks:      blocks * 16 bytes, one tweak per block
+ * @par[in]blocks:      number of blocks
+ */
+void aes_ttable_xts_encrypt_128_blocks(const uint8_t *roundkeys, uint8_t *data, const uint8_t *tweaks, size_t blocks);
+
+/**
+ * @purpose:                In-place XTS style decryption of many consecutive blocks, see aes_ttable_xts_encrypt_128_blocks
+ * @par[in]dec_roundkeys:   round keys from aes_decrypt_key_schedule_128
+ * @par[in,out]data:        blocks * 16 bytes
+ * @par[in]tweaks:          blocks * 16 bytes, one tweak per block
+ * @par[in]blocks:          number of blocks
+ */
+void aes_ttable_xts_decrypt_128_blocks(const uint8_t *dec_roundkeys, uint8_t *data, const uint8_t *tweaks, size_t blocks);
+
 #endif
@@ -0,0 +1,437 @@
+/*
+ * Constant-time bitsliced AES-128, see aes_ct.h.
+ *
+ * Layout: q[b] holds bit b of every byte of four blocks. Within a word, byte (row r, column c)
+ * of block k sits at bit r * 16 + c * 4 + k, so a row is a 16-bit lane, ShiftRows rotates
+ * inside the lanes and the rows MixColumns combines are the word rotated by multiples of 16.
+ */
+extern "C" {
+#include <string.h>
+
+#include "aes_ct.h"
+
+/*
+ * 8x8 bit transposes in each byte position of the eight words: afterwards bit i of byte j of
+ * q[b] is what bit b of byte j of q[i] was. It's its own inverse.
+ */
+#define SWAPN(cl, ch, s, x, y) do { \
+        uint64_t a = (x), b = (y); \
+        (x) = (a & (uint64_t)(cl)) | ((b & (uint64_t)(cl)) << (s)); \
+        (y) = ((a & (uint64_t)(ch)) >> (s)) | (b & (uint64_t)(ch)); \
+    } while (0)
+
+static void ortho(uint64_t *q) {
+    SWAPN(0x5555555555555555, 0xAAAAAAAAAAAAAAAA, 1, q[0], q[1]);
+    SWAPN(0x5555555555555555, 0xAAAAAAAAAAAAAAAA, 1, q[2], q[3]);
+    SWAPN(0x5555555555555555, 0xAAAAAAAAAAAAAAAA, 1, q[4], q[5]);
+    SWAPN(0x5555555555555555, 0xAAAAAAAAAAAAAAAA, 1, q[6], q[7]);
+
+    SWAPN(0x3333333333333333, 0xCCCCCCCCCCCCCCCC, 2, q[0], q[2]);
+    SWAPN(0x3333333333333333, 0xCCCCCCCCCCCCCCCC, 2, q[1], q[3]);
+    SWAPN(0x3333333333333333, 0xCCCCCCCCCCCCCCCC, 2, q[4], q[6]);
+    SWAPN(0x3333333333333333, 0xCCCCCCCCCCCCCCCC, 2, q[5], q[7]);
+
+    SWAPN(0x0F0F0F0F0F0F0F0F, 0xF0F0F0F0F0F0F0F0, 4, q[0], q[4]);
+    SWAPN(0x0F0F0F0F0F0F0F0F, 0xF0F0F0F0F0F0F0F0, 4, q[1], q[5]);
+    SWAPN(0x0F0F0F0F0F0F0F0F, 0xF0F0F0F0F0F0F0F0, 4, q[2], q[6]);
+    SWAPN(0x0F0F0F0F0F0F0F0F, 0xF0F0F0F0F0F0F0F0, 4, q[3], q[7]);
+}
+
+/*
+ * Four blocks (64 bytes) in and out of the bitsliced form. Bytes are first put where the
+ * transpose moves them to their layout position: bit r * 16 + c * 4 + k is byte 2r + c / 2
+ * of word (c % 2) * 4 + k.
+ */
+static void pack(const uint8_t *in, uint64_t *q) {
+    int k, c, r;
+    memset(q, 0, 8 * sizeof(uint64_t));
+    for (k = 0; k < 4; ++k) {
+        for (c = 0; c < 4; ++c) {
+            for (r = 0; r < 4; ++r) {
+                q[(c & 1) * 4 + k] |= (uint64_t)in[k * 16 + c * 4 + r] << (8 * (2 * r + (c >> 1)));
+            }
+        }
+    }
+    ortho(q);
+}
+
+static void unpack(uint64_t *q, uint8_t *out) {
+    int k, c, r;
+    ortho(q);
+    for (k = 0; k < 4; ++k) {
+        for (c = 0; c < 4; ++c) {
+            for (r = 0; r < 4; ++r) {
+                out[k * 16 + c * 4 + r] = (uint8_t)(q[(c & 1) * 4 + k] >> (8 * (2 * r + (c >> 1))));
+            }
+        }
+    }
+}
+
+/*
+ * SubBytes as the Boyar-Peralta circuit (113 gates), x0 being the top bit.
+ */
+static void sub_bytes(uint64_t *q) {
+    uint64_t x0, x1, x2, x3, x4, x5, x6, x7;
+    uint64_t y1, y2, y3, y4, y5, y6, y7, y8, y9;
+    uint64_t y10, y11, y12, y13, y14, y15, y16, y17, y18, y19;
+    uint64_t y20, y21;
+    uint64_t z0, z1, z2, z3, z4, z5, z6, z7, z8, z9;
+    uint64_t z10, z11, z12, z13, z14, z15, z16, z17;
+    uint64_t t0, t1, t2, t3, t4, t5, t6, t7, t8, t9;
+    uint64_t t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+    uint64_t t20, t21, t22, t23, t24, t25, t26, t27, t28, t29;
+    uint64_t t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+    uint64_t t40, t41, t42, t43, t44, t45, t46, t47, t48, t49;
+    uint64_t t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+    uint64_t t60, t61, t62, t63, t64, t65, t66, t67;
+    uint64_t s0, s1, s2, s3, s4, s5, s6, s7;
+
+    x0 = q[7]; x1 = q[6]; x2 = q[5]; x3 = q[4];
+    x4 = q[3]; x5 = q[2]; x6 = q[1]; x7 = q[0];
+
+    // top linear transformation
+    y14 = x3 ^ x5;
+    y13 = x0 ^ x6;
+    y9 = x0 ^ x3;
+    y8 = x0 ^ x5;
+    t0 = x1 ^ x2;
+    y1 = t0 ^ x7;
+    y4 = y1 ^ x3;
+    y12 = y13 ^ y14;
+    y2 = y1 ^ x0;
+    y5 = y1 ^ x6;
+    y3 = y5 ^ y8;
+    t1 = x4 ^ y12;
+    y15 = t1 ^ x5;
+    y20 = t1 ^ x1;
+    y6 = y15 ^ x7;
+    y10 = y15 ^ t0;
+    y11 = y20 ^ y9;
+    y7 = x7 ^ y11;
+    y17 = y10 ^ y11;
+    y19 = y10 ^ y8;
+    y16 = t0 ^ y11;
+    y21 = y13 ^ y16;
+    y18 = x0 ^ y16;
+
+    // non-linear section
+    t2 = y12 & y15;
+    t3 = y3 & y6;
+    t4 = t3 ^ t2;
+    t5 = y4 & x7;
+    t6 = t5 ^ t2;
+    t7 = y13 & y16;
+    t8 = y5 & y1;
+    t9 = t8 ^ t7;
+    t10 = y2 & y7;
+    t11 = t10 ^ t7;
+    t12 = y9 & y11;
+    t13 = y14 & y17;
+    t14 = t13 ^ t12;
+    t15 = y8 & y10;
+    t16 = t15 ^ t12;
+    t17 = t4 ^ t14;
+    t18 = t6 ^ t16;
+    t19 = t9 ^ t14;
+    t20 = t11 ^ t16;
+    t21 = t17 ^ y20;
+    t22 = t18 ^ y19;
+    t23 = t19 ^ y21;
+    t24 = t20 ^ y18;
+
+    t25 = t21 ^ t22;
+    t26 = t21 & t23;
+    t27 = t24 ^ t26;
+    t28 = t25 & t27;
+    t29 = t28 ^ t22;
+    t30 = t23 ^ t24;
+    t31 = t22 ^ t26;
+    t32 = t31 & t30;
+    t33 = t32 ^ t24;
+    t34 = t23 ^ t33;
+    t35 = t27 ^ t33;
+    t36 = t24 & t35;
+    t37 = t36 ^ t34;
+    t38 = t27 ^ t36;
+    t39 = t29 & t38;
+    t40 = t25 ^ t39;
+
+    t41 = t40 ^ t37;
+    t42 = t29 ^ t33;
+    t43 = t29 ^ t40;
+    t44 = t33 ^ t37;
+    t45 = t42 ^ t41;
+    z0 = t44 & y15;
+    z1 = t37 & y6;
+    z2 = t33 & x7;
+    z3 = t43 & y16;
+    z4 = t40 & y1;
+    z5 = t29 & y7;
+    z6 = t42 & y11;
+    z7 = t45 & y17;
+    z8 = t41 & y10;
+    z9 = t44 & y12;
+    z10 = t37 & y3;
+    z11 = t33 & y4;
+    z12 = t43 & y13;
+    z13 = t40 & y5;
+    z14 = t29 & y2;
+    z15 = t42 & y9;
+    z16 = t45 & y14;
+    z17 = t41 & y8;
+
+    // bottom linear transformation
+    t46 = z15 ^ z16;
+    t47 = z10 ^ z11;
+    t48 = z5 ^ z13;
+    t49 = z9 ^ z10;
+    t50 = z2 ^ z12;
+    t51 = z2 ^ z5;
+    t52 = z7 ^ z8;
+    t53 = z0 ^ z3;
+    t54 = z6 ^ z7;
+    t55 = z16 ^ z17;
+    t56 = z12 ^ t48;
+    t57 = t50 ^ t53;
+    t58 = z4 ^ t46;
+    t59 = z3 ^ t54;
+    t60 = t46 ^ t57;
+    t61 = z14 ^ t57;
+    t62 = t52 ^ t58;
+    t63 = t49 ^ t58;
+    t64 = z4 ^ t59;
+    t65 = t61 ^ t62;
+    t66 = z1 ^ t63;
+    s0 = t59 ^ t63;
+    s6 = t56 ^ ~t62;
+    s7 = t48 ^ ~t60;
+    t67 = t64 ^ t65;
+    s3 = t53 ^ t66;
+    s4 = t51 ^ t66;
+    s5 = t47 ^ t65;
+    s1 = t64 ^ ~s3;
+    s2 = t55 ^ ~t67;
+
+    q[7] = s0; q[6] = s1; q[5] = s2; q[4] = s3;
+    q[3] = s4; q[2] = s5; q[1] = s6; q[0] = s7;
+}
+
+/*
+ * The inverse of the affine part of SubBytes (with its constant 0x63). InvSubBytes is this,
+ * then SubBytes, then this again: the affine parts in the middle cancel out and the field
+ * inversion in SubBytes is its own inverse.
+ */
+static void inv_affine(uint64_t *q) {
+    uint64_t q0 = ~q[0], q1 = ~q[1], q2 = q[2], q3 = q[3];
+    uint64_t q4 = q[4], q5 = ~q[5], q6 = ~q[6], q7 = q[7];
+    q[7] = q1 ^ q4 ^ q6;
+    q[6] = q0 ^ q3 ^ q5;
+    q[5] = q7 ^ q2 ^ q4;
+    q[4] = q6 ^ q1 ^ q3;
+    q[3] = q5 ^ q0 ^ q2;
+    q[2] = q4 ^ q7 ^ q1;
+    q[1] = q3 ^ q6 ^ q0;
+    q[0] = q2 ^ q5 ^ q7;
+}
+
+static void inv_sub_bytes(uint64_t *q) {
+    inv_affine(q);
+    sub_bytes(q);
+    inv_affine(q);
+}
+
+// row r (the 16 bits at r * 16) rotated by r columns (4 bits each)
+static void shift_rows(uint64_t *q) {
+    int i;
+    for (i = 0; i < 8; ++i) {
+        uint64_t x = q[i];
+        q[i] = (x & 0x000000000000FFFF)
+            | ((x & 0x00000000FFF00000) >> 4) | ((x & 0x00000000000F0000) << 12)
+            | ((x & 0x0000FF0000000000) >> 8) | ((x & 0x000000FF00000000) << 8)
+            | ((x & 0xF000000000000000) >> 12) | ((x & 0x0FFF000000000000) << 4);
+    }
+}
+
+static void inv_shift_rows(uint64_t *q) {
+    int i;
+    for (i = 0; i < 8; ++i) {
+        uint64_t x = q[i];
+        q[i] = (x & 0x000000000000FFFF)
+            | ((x & 0x000000000FFF0000) << 4) | ((x & 0x00000000F0000000) >> 12)
+            | ((x & 0x0000FF0000000000) >> 8) | ((x & 0x000000FF00000000) << 8)
+            | ((x & 0xFFF0000000000000) >> 4) | ((x & 0x000F000000000000) << 12);
+    }
+}
+
+// the rows n below, brought up to each row
+static inline uint64_t rows(uint64_t x, int n) {
+    return (x >> (16 * n)) | (x << (64 - 16 * n));
+}
+
+/*
+ * MixColumns: out_r = 2 * (a_r ^ a_r+1) ^ a_r+1 ^ a_r+2 ^ a_r+3, doubling being a shift
+ * across the bit words with the top one folded back in as 0x1b.
+ */
+static void mix_columns(uint64_t *q) {
+    uint64_t t[8], r[8];
+    int i;
+    for (i = 0; i < 8; ++i) {
+        r[i] = rows(q[i], 1);
+        t[i] = q[i] ^ r[i];
+        r[i] ^= rows(q[i], 2) ^ rows(q[i], 3);
+    }
+    q[0] = t[7] ^ r[0];
+    q[1] = t[0] ^ t[7] ^ r[1];
+    q[2] = t[1] ^ r[2];
+    q[3] = t[2] ^ t[7] ^ r[3];
+    q[4] = t[3] ^ t[7] ^ r[4];
+    q[5] = t[4] ^ r[5];
+    q[6] = t[5] ^ r[6];
+    q[7] = t[6] ^ r[7];
+}
+
+/*
+ * InvMixColumns is MixColumns after a_r ^= 4 * (a_r ^ a_r+2), since
+ * [0e 0b 0d 09] = [02 03 01 01] * [05 00 04 00].
+ */
+static void inv_mix_columns(uint64_t *q) {
+    uint64_t t[8];
+    int i;
+    for (i = 0; i < 8; ++i) {
+        t[i] = q[i] ^ rows(q[i], 2);
+    }
+    // times 4 is two doublings, 0x1b folding in for each of the top two bits
+    q[0] ^= t[6];
+    q[1] ^= t[7] ^ t[6];
+    q[2] ^= t[0] ^ t[7];
+    q[3] ^= t[1] ^ t[6];
+    q[4] ^= t[2] ^ t[7] ^ t[6];
+    q[5] ^= t[3] ^ t[7];
+    q[6] ^= t[4];
+    q[7] ^= t[5];
+    mix_columns(q);
+}
+
+static inline void add_round_key(uint64_t *q, const uint64_t *sk) {
+    int i;
+    for (i = 0; i < 8; ++i) {
+        q[i] ^= sk[i];
+    }
+}
+
+void aes_ct_pack_roundkeys_128(const uint8_t *roundkeys, uint64_t *sk) {
+    uint8_t tmp[64];
+    int i;
+    for (i = 0; i < 11; ++i) {
+        memcpy(tmp, roundkeys + i * 16, 16);
+        memcpy(tmp + 16, tmp, 16);
+        memcpy(tmp + 32, tmp, 32);
+        pack(tmp, sk + i * 8);
+    }
+}
+
+void aes_ct_key_schedule_128(const uint8_t *key, uint8_t *roundkeys) {
+    static const uint8_t rcon[10] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36};
+    uint64_t q[8];
+    uint8_t tmp[64];
+    int i, j;
+    memcpy(roundkeys, key, 16);
+    memset(tmp, 0, sizeof(tmp));
+    for (i = 0; i < 10; ++i) {
+        const uint8_t *prev = roundkeys + i * 16;
+        uint8_t *next = roundkeys + i * 16 + 16;
+        // SubWord of the last column as the first bytes of a block, the rest of the block is ignored
+        memcpy(tmp, prev + 12, 4);
+        pack(tmp, q);
+        sub_bytes(q);
+        unpack(q, tmp);
+        // RotWord after SubWord, they work byte by byte so the order doesn't matter
+        next[0] = prev[0] ^ tmp[1] ^ rcon[i];
+        next[1] = prev[1] ^ tmp[2];
+        next[2] = prev[2] ^ tmp[3];
+        next[3] = prev[3] ^ tmp[0];
+        for (j = 4; j < 16; ++j) {
+            next[j] = prev[j] ^ next[j - 4];
+        }
+    }
+}
+
+// a and b are two sets of four blocks, done round by round together so their work can overlap
+static void encrypt_x8(const uint64_t *sk, uint64_t *a, uint64_t *b) {
+    int i;
+    add_round_key(a, sk);
+    add_round_key(b, sk);
+    for (i = 1; i < 10; ++i) {
+        sub_bytes(a); sub_bytes(b);
+        shift_rows(a); shift_rows(b);
+        mix_columns(a); mix_columns(b);
+        add_round_key(a, sk + i * 8); add_round_key(b, sk + i * 8);
+    }
+    sub_bytes(a); sub_bytes(b);
+    shift_rows(a); shift_rows(b);
+    add_round_key(a, sk + 80); add_round_key(b, sk + 80);
+}
+
+static void decrypt_x8(const uint64_t *sk, uint64_t *a, uint64_t *b) {
+    int i;
+    add_round_key(a, sk + 80);
+    add_round_key(b, sk + 80);
+    for (i = 9; i > 0; --i) {
+        inv_shift_rows(a); inv_shift_rows(b);
+        inv_sub_bytes(a); inv_sub_bytes(b);
+        add_round_key(a, sk + i * 8); add_round_key(b, sk + i * 8);
+        inv_mix_columns(a); inv_mix_columns(b);
+    }
+    inv_shift_rows(a); inv_shift_rows(b);
+    inv_sub_bytes(a); inv_sub_bytes(b);
+    add_round_key(a, sk); add_round_key(b, sk);
+}
+
+void aes_ct_encrypt_128_blocks(const uint64_t *sk, uint8_t *data, size_t blocks) {
+    uint64_t a[8], b[8];
+    uint8_t tmp[128];
+    size_t n;
+    for (; blocks; blocks -= n, data += n * 16) {
+        n = blocks < 8 ? blocks : 8;
+        memset(tmp, 0, sizeof(tmp));
+        memcpy(tmp, data, n * 16);
+        pack(tmp, a);
+        pack(tmp + 64, b);
+        encrypt_x8(sk, a, b);
+        unpack(a, tmp);
+        unpack(b, tmp + 64);
+        memcpy(data, tmp, n * 16);
+    }
+}
+
+// eight blocks at a time through tmp, the tweaks xored on the way in and out
+#define AES_CT_XTS_BLOCKS(crypt_x8) do { \
+    uint64_t a[8], b[8]; \
+    uint8_t tmp[128]; \
+    size_t i, n; \
+    for (; blocks; blocks -= n, data += n * 16, tweaks += n * 16) { \
+        n = blocks < 8 ? blocks : 8; \
+        memset(tmp, 0, sizeof(tmp)); \
+        for (i = 0; i < n * 16; ++i) { \
+            tmp[i] = data[i] ^ tweaks[i]; \
+        } \
+        pack(tmp, a); \
+        pack(tmp + 64, b); \
+        crypt_x8(sk, a, b); \
+        unpack(a, tmp); \
+        unpack(b, tmp + 64); \
+        for (i = 0; i < n * 16; ++i) { \
+            data[i] = tmp[i] ^ tweaks[i]; \
+        } \
+    } \
+} while(0)
+
+void aes_ct_xts_encrypt_128_blocks(const uint64_t *sk, uint8_t *data, const uint8_t *tweaks, size_t blocks) {
+    AES_CT_XTS_BLOCKS(encrypt_x8);
+}
+
+void aes_ct_xts_decrypt_128_blocks(const uint64_t *sk, uint8_t *data, const uint8_t *tweaks, size_t blocks) {
+    AES_CT_XTS_BLOCKS(decrypt_x8);
+}
+
+} //extern
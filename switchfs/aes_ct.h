@@ -0,0 +1,63 @@
+/*
+ * Constant-time AES-128, bitsliced over 64-bit words.
+ *
+ * Four blocks are spread over eight words, one word per bit of every byte, so SubBytes is a
+ * boolean circuit (Boyar-Peralta) instead of a table lookup and nothing depends on secret
+ * indices or branches. The block functions run two of those sets side by side, eight blocks
+ * at a time; fewer blocks are padded out, so short inputs cost as much as eight blocks.
+ *
+ * The ciphers take the round keys bitsliced the same way, from aes_ct_pack_roundkeys_128.
+ * Packing them is as much work as crypting a few blocks, so it's done once per key. Decryption
+ * runs the straightforward inverse cipher, so it takes the encryption round keys too.
+ */
+#ifndef AES_CT_128_H
+#define AES_CT_128_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define AES_CT_ROUNDKEY_WORDS 88 // 11 round keys, each spread over all four blocks of a set
+
+/**
+ * @purpose:            Key schedule for AES-128, the same as aes_key_schedule_128 but with SubWord
+ *                      through the circuit instead of the S-box table
+ * @par[in]key:         16 bytes of master keys
+ * @par[out]roundkeys:  176 bytes of round keys
+ */
+void aes_ct_key_schedule_128(const uint8_t *key, uint8_t *roundkeys);
+
+/**
+ * @purpose:            Bitslice round keys for the functions below
+ * @par[in]roundkeys:   176 bytes of round keys from aes_ct_key_schedule_128
+ * @par[out]sk:         AES_CT_ROUNDKEY_WORDS words
+ */
+void aes_ct_pack_roundkeys_128(const uint8_t *roundkeys, uint64_t *sk);
+
+/**
+ * @purpose:            In-place encryption of many independent blocks, eight at a time
+ * @par[in]sk:          round keys from aes_ct_pack_roundkeys_128
+ * @par[in,out]data:    blocks * 16 bytes
+ * @par[in]blocks:      number of blocks
+ */
+void aes_ct_encrypt_128_blocks(const uint64_t *sk, uint8_t *data, size_t blocks);
+
+/**
+ * @purpose:            In-place XTS style encryption of many consecutive blocks:
+ *                      each block is xored with its tweak, encrypted and xored again
+ * @par[in]sk:          round keys from aes_ct_pack_roundkeys_128
+ * @par[in,out]data:    blocks * 16 bytes
+ * @par[in]tweaks:      blocks * 16 bytes, one tweak per block
+ * @par[in]blocks:      number of blocks
+ */
+void aes_ct_xts_encrypt_128_blocks(const uint64_t *sk, uint8_t *data, const uint8_t *tweaks, size_t blocks);
+
+/**
+ * @purpose:            In-place XTS style decryption of many consecutive blocks, see aes_ct_xts_encrypt_128_blocks
+ * @par[in]sk:          round keys from aes_ct_pack_roundkeys_128 (the encryption ones)
+ * @par[in,out]data:    blocks * 16 bytes
+ * @par[in]tweaks:      blocks * 16 bytes, one tweak per block
+ * @par[in]blocks:      number of blocks
+ */
+void aes_ct_xts_decrypt_128_blocks(const uint64_t *sk, uint8_t *data, const uint8_t *tweaks, size_t blocks);
+
+#endif
@@ -0,0 +1,114 @@
+/*
+ * AES-128 using the x86 AES-NI instructions, see aesni.h.
+ *
+ * The functions are compiled for the aes target individually, so the rest of
+ * the extension does not need -maes and still loads on CPUs without it.
+ */
+extern "C" {
+#include "aesni.h"
+}
+
+#ifdef AESNI_BUILD
+
+#include <wmmintrin.h>
+#include <emmintrin.h>
+
+#if defined _MSC_VER && !defined __clang__
+#include <intrin.h>
+#define AESNI_TARGET
+#else
+#include <cpuid.h>
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+#endif
+
+extern "C" {
+
+int aesni_supported(void) {
+    unsigned int ecx;
+    #if defined _MSC_VER && !defined __clang__
+    int info[4];
+    __cpuid(info, 1);
+    ecx = (unsigned int)info[2];
+    #else
+    unsigned int eax, ebx, edx;
+    if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return 0;
+    #endif
+    return (ecx >> 25) & 1;
+}
+
+AESNI_TARGET
+void aesni_encrypt_128(const uint8_t *roundkeys, const uint8_t *plaintext, uint8_t *ciphertext) {
+    const __m128i *rk = (const __m128i *)roundkeys;
+    __m128i m = _mm_xor_si128(_mm_loadu_si128((const __m128i *)plaintext), _mm_loadu_si128(rk));
+    int i;
+
+    for (i = 1; i < 10; ++i) {
+        m = _mm_aesenc_si128(m, _mm_loadu_si128(rk + i));
+    }
+    _mm_storeu_si128((__m128i *)ciphertext, _mm_aesenclast_si128(m, _mm_loadu_si128(rk + 10)));
+}
+
+AESNI_TARGET
+void aesni_decrypt_128(const uint8_t *dec_roundkeys, const uint8_t *ciphertext, uint8_t *plaintext) {
+    const __m128i *rk = (const __m128i *)dec_roundkeys;
+    __m128i m = _mm_xor_si128(_mm_loadu_si128((const __m128i *)ciphertext), _mm_loadu_si128(rk));
+    int i;
+
+    for (i = 1; i < 10; ++i) {
+        m = _mm_aesdec_si128(m, _mm_loadu_si128(rk + i));
+    }
+    _mm_storeu_si128((__m128i *)plaintext, _mm_aesdeclast_si128(m, _mm_loadu_si128(rk + 10)));
+}
+
+//one round over all eight blocks, so no block waits on the one before it
+#define AESNI_ROUND_X8(op, b, k) do { \
+    b[0] = op(b[0], k); b[1] = op(b[1], k); b[2] = op(b[2], k); b[3] = op(b[3], k); \
+    b[4] = op(b[4], k); b[5] = op(b[5], k); b[6] = op(b[6], k); b[7] = op(b[7], k); \
+} while(0)
+
+//the tweaks are loaded again for the final xor, there are not enough xmm registers to keep them
+#define AESNI_XTS_BLOCKS(aesround, aeslast) do { \
+    const __m128i *rk = (const __m128i *)roundkeys; \
+    const __m128i *t = (const __m128i *)tweaks; \
+    __m128i *d = (__m128i *)data; \
+    __m128i k[11], b[8]; \
+    int i, j; \
+    for (i = 0; i < 11; ++i) { \
+        k[i] = _mm_loadu_si128(rk + i); \
+    } \
+    for (; blocks >= 8; blocks -= 8, d += 8, t += 8) { \
+        for (j = 0; j < 8; ++j) { \
+            b[j] = _mm_xor_si128(_mm_xor_si128(_mm_loadu_si128(d + j), _mm_loadu_si128(t + j)), k[0]); \
+        } \
+        for (i = 1; i < 10; ++i) { \
+            AESNI_ROUND_X8(aesround, b, k[i]); \
+        } \
+        AESNI_ROUND_X8(aeslast, b, k[10]); \
+        for (j = 0; j < 8; ++j) { \
+            _mm_storeu_si128(d + j, _mm_xor_si128(b[j], _mm_loadu_si128(t + j))); \
+        } \
+    } \
+    for (; blocks; --blocks, ++d, ++t) { \
+        __m128i tw = _mm_loadu_si128(t); \
+        b[0] = _mm_xor_si128(_mm_xor_si128(_mm_loadu_si128(d), tw), k[0]); \
+        for (i = 1; i < 10; ++i) { \
+            b[0] = aesround(b[0], k[i]); \
+        } \
+        _mm_storeu_si128(d, _mm_xor_si128(aeslast(b[0], k[10]), tw)); \
+    } \
+} while(0)
+
+AESNI_TARGET
+void aesni_xts_encrypt_128_blocks(const uint8_t *roundkeys, uint8_t *data, const uint8_t *tweaks, size_t blocks) {
+    AESNI_XTS_BLOCKS(_mm_aesenc_si128, _mm_aesenclast_si128);
+}
+
+AESNI_TARGET
+void aesni_xts_decrypt_128_blocks(const uint8_t *dec_roundkeys, uint8_t *data, const uint8_t *tweaks, size_t blocks) {
+    const uint8_t *roundkeys = dec_roundkeys;
+    AESNI_XTS_BLOCKS(_mm_aesdec_si128, _mm_aesdeclast_si128);
+}
+
+} //extern
+
+#endif
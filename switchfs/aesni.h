@@ -0,0 +1,65 @@
+/*
+ * AES-128 using the x86 AES-NI instructions.
+ *
+ * Round keys use the same layout as aes_key_schedule_128 in aes.h, so the
+ * portable key schedule is shared. Decryption uses the "equivalent inverse
+ * cipher" keys from aes_decrypt_key_schedule_128, which is what AESDEC expects.
+ *
+ * Nothing in here may be called unless aesni_supported() returned non-zero.
+ */
+#ifndef AESNI_128_H
+#define AESNI_128_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined __x86_64__ || defined _M_X64 || defined __i386__ || defined _M_IX86
+#define AESNI_BUILD 1
+
+/**
+ * @purpose:            Check through cpuid if the CPU has AES-NI.
+ * @return:             non-zero if the functions below may be used
+ */
+int aesni_supported(void);
+
+/**
+ * @purpose:            Encryption of one block (16 bytes).
+ *                      The plaintext and ciphertext may point to the same memory
+ * @par[in]roundkeys:   round keys from aes_key_schedule_128
+ * @par[in]plaintext:   plain text
+ * @par[out]ciphertext: cipher text
+ */
+void aesni_encrypt_128(const uint8_t *roundkeys, const uint8_t *plaintext, uint8_t *ciphertext);
+
+/**
+ * @purpose:                Decryption of one block (16 bytes).
+ *                          The ciphertext and plaintext may point to the same memory
+ * @par[in]dec_roundkeys:   round keys from aes_decrypt_key_schedule_128
+ * @par[in]ciphertext:      cipher text
+ * @par[out]plaintext:      plain text
+ */
+void aesni_decrypt_128(const uint8_t *dec_roundkeys, const uint8_t *ciphertext, uint8_t *plaintext);
+
+/**
+ * @purpose:            In-place XTS style encryption of many consecutive blocks:
+ *                      each block is xored with its tweak, encrypted and xored again.
+ *                      Eight blocks are kept in flight at once to hide the AESENC latency
+ * @par[in]roundkeys:   round keys from aes_key_schedule_128
+ * @par[in,out]data:    blocks * 16 bytes
+ * @par[in]tweaks:      blocks * 16 bytes, one tweak per block
+ * @par[in]blocks:      number of blocks
+ */
+void aesni_xts_encrypt_128_blocks(const uint8_t *roundkeys, uint8_t *data, const uint8_t *tweaks, size_t blocks);
+
+/**
+ * @purpose:                In-place XTS style decryption of many consecutive blocks, see aesni_xts_encrypt_128_blocks
+ * @par[in]dec_roundkeys:   round keys from aes_decrypt_key_schedule_128
+ * @par[in,out]data:        blocks * 16 bytes
+ * @par[in]tweaks:          blocks * 16 bytes, one tweak per block
+ * @par[in]blocks:          number of blocks
+ */
+void aesni_xts_decrypt_128_blocks(const uint8_t *dec_roundkeys, uint8_t *data, const uint8_t *tweaks, size_t blocks);
+
+#endif
+
+#endif
@@ -0,0 +1,114 @@
+/*
+ * AES-128 using the ARMv8 Crypto Extensions, see armv8.h.
+ *
+ * As with aesni.cpp the functions are compiled for the crypto target individually, so the
+ * extension builds for plain armv8-a and still loads on cores without the extension.
+ */
+extern "C" {
+#include "armv8.h"
+}
+
+#ifdef ARMV8_AES_BUILD
+
+#include <arm_neon.h>
+
+#if defined __linux__ || defined __ANDROID__
+#include <sys/auxv.h>
+#ifndef HWCAP_AES
+#define HWCAP_AES (1 << 3)
+#endif
+#elif defined __FreeBSD__
+#include <sys/auxv.h>
+#include <machine/elf.h>
+#endif
+
+#ifdef __clang__
+#define ARMV8_TARGET __attribute__((target("aes")))
+#else
+#define ARMV8_TARGET __attribute__((target("+crypto")))
+#endif
+
+extern "C" {
+
+int armv8_aes_supported(void) {
+    #if defined __linux__ || defined __ANDROID__
+    return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+    #elif defined __FreeBSD__
+    unsigned long hwcap = 0;
+    if(elf_aux_info(AT_HWCAP, &hwcap, sizeof(hwcap))) return 0;
+    return (hwcap & HWCAP_AES) != 0;
+    #elif defined __APPLE__
+    //every arm64 mac and ios device has them
+    return 1;
+    #else
+    return 0;
+    #endif
+}
+
+ARMV8_TARGET
+void armv8_encrypt_128(const uint8_t *roundkeys, const uint8_t *plaintext, uint8_t *ciphertext) {
+    uint8x16_t m = vld1q_u8(plaintext);
+    int i;
+
+    for (i = 0; i < 9; ++i) {
+        m = vaesmcq_u8(vaeseq_u8(m, vld1q_u8(roundkeys + i * 16)));
+    }
+    m = vaeseq_u8(m, vld1q_u8(roundkeys + 9 * 16));
+    vst1q_u8(ciphertext, veorq_u8(m, vld1q_u8(roundkeys + 10 * 16)));
+}
+
+//aese and aesmc are kept next to each other per block, cores fuse the pair when they are
+#define ARMV8_ROUND_X8(round, mix, b, k) do { \
+    b[0] = mix(round(b[0], k)); b[1] = mix(round(b[1], k)); \
+    b[2] = mix(round(b[2], k)); b[3] = mix(round(b[3], k)); \
+    b[4] = mix(round(b[4], k)); b[5] = mix(round(b[5], k)); \
+    b[6] = mix(round(b[6], k)); b[7] = mix(round(b[7], k)); \
+} while(0)
+
+#define ARMV8_NOMIX(x) (x)
+
+//there are 32 vector registers, enough to keep the keys, eight blocks and their tweaks
+#define ARMV8_XTS_BLOCKS(round, mix) do { \
+    uint8x16_t k[11], b[8], tw[8]; \
+    int i, j; \
+    for (i = 0; i < 11; ++i) { \
+        k[i] = vld1q_u8(roundkeys + i * 16); \
+    } \
+    for (; blocks >= 8; blocks -= 8, data += 128, tweaks += 128) { \
+        for (j = 0; j < 8; ++j) { \
+            tw[j] = vld1q_u8(tweaks + j * 16); \
+            b[j] = veorq_u8(vld1q_u8(data + j * 16), tw[j]); \
+        } \
+        for (i = 0; i < 9; ++i) { \
+            ARMV8_ROUND_X8(round, mix, b, k[i]); \
+        } \
+        ARMV8_ROUND_X8(round, ARMV8_NOMIX, b, k[9]); \
+        for (j = 0; j < 8; ++j) { \
+            vst1q_u8(data + j * 16, veorq_u8(veorq_u8(b[j], k[10]), tw[j])); \
+        } \
+    } \
+    for (; blocks; --blocks, data += 16, tweaks += 16) { \
+        tw[0] = vld1q_u8(tweaks); \
+        b[0] = veorq_u8(vld1q_u8(data), tw[0]); \
+        for (i = 0; i < 9; ++i) { \
+            b[0] = mix(round(b[0], k[i])); \
+        } \
+        b[0] = round(b[0], k[9]); \
+        vst1q_u8(data, veorq_u8(veorq_u8(b[0], k[10]), tw[0])); \
+    } \
+} while(0)
+
+ARMV8_TARGET
+void armv8_xts_encrypt_128_blocks(const uint8_t *roundkeys, uint8_t *data, const uint8_t *tweaks, size_t blocks) {
+    ARMV8_XTS_BLOCKS(vaeseq_u8, vaesmcq_u8);
+}
+
+ARMV8_TARGET
+void armv8_xts_decrypt_128_blocks(const uint8_t *dec_roundkeys, uint8_t *data, const uint8_t *tweaks, size_t blocks) {
+    const uint8_t *roundkeys = dec_roundkeys;
+    ARMV8_XTS_BLOCKS(vaesdq_u8, vaesimcq_u8);
+}
+
+} //extern
+
+#endif
@@ -0,0 +1,60 @@
+/*
+ * AES-128 using the ARMv8 Crypto Extensions (AESE, AESD, AESMC, AESIMC) on aarch64.
+ *
+ * Round keys use the same layout as aes_key_schedule_128 in aes.h. Like AES-NI, decryption
+ * uses the "equivalent inverse cipher" keys from aes_decrypt_key_schedule_128; AESD and AESE
+ * xor the key in before the round rather than after, so the last key is xored in separately.
+ *
+ * Nothing in here may be called unless armv8_aes_supported() returned non-zero.
+ */
+#ifndef ARMV8_AES_128_H
+#define ARMV8_AES_128_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//gcc can enable the crypto intrinsics per function since 6, clang only since 16 unless the
+//whole build already targets them
+#if defined __aarch64__ && \
+    ((defined __GNUC__ && !defined __clang__ && __GNUC__ >= 6) || \
+     (defined __clang__ && (__clang_major__ >= 16 || defined __ARM_FEATURE_AES || defined __ARM_FEATURE_CRYPTO)))
+#define ARMV8_AES_BUILD 1
+
+/**
+ * @purpose:            Check through the ELF auxiliary vector (or the OS) if the CPU has the AES instructions.
+ * @return:             non-zero if the functions below may be used
+ */
+int armv8_aes_supported(void);
+
+/**
+ * @purpose:            Encryption of one block (16 bytes).
+ *                      The plaintext and ciphertext may point to the same memory
+ * @par[in]roundkeys:   round keys from aes_key_schedule_128
+ * @par[in]plaintext:   plain text
+ * @par[out]ciphertext: cipher text
+ */
+void armv8_encrypt_128(const uint8_t *roundkeys, const uint8_t *plaintext, uint8_t *ciphertext);
+
+/**
+ * @purpose:            In-place XTS style encryption of many consecutive blocks:
+ *                      each block is xored with its tweak, encrypted and xored again.
+ *                      Eight blocks are kept in flight at once to hide the AESE latency
+ * @par[in]roundkeys:   round keys from aes_key_schedule_128
+ * @par[in,out]data:    blocks * 16 bytes
+ * @par[in]tweaks:      blocks * 16 bytes, one tweak per block
+ * @par[in]blocks:      number of blocks
+ */
+void armv8_xts_encrypt_128_blocks(const uint8_t *roundkeys, uint8_t *data, const uint8_t *tweaks, size_t blocks);
+
+/**
+ * @purpose:                In-place XTS style decryption of many consecutive blocks, see armv8_xts_encrypt_128_blocks
+ * @par[in]dec_roundkeys:   round keys from aes_decrypt_key_schedule_128
+ * @par[in,out]data:        blocks * 16 bytes
+ * @par[in]tweaks:          blocks * 16 bytes, one tweak per block
+ * @par[in]blocks:          number of blocks
+ */
+void armv8_xts_decrypt_128_blocks(const uint8_t *dec_roundkeys, uint8_t *data, const uint8_t *tweaks, size_t blocks);
+
+#endif
+
+#endif
@@ -1,379 +1,286 @@
 #include <Python.h>
 
-#include <cstdio>
+#include <climits>
 #include <cstring>
-#include <inttypes.h>
+#include <list>
+#include <new>
+#include <unordered_map>
+#include <utility>
 
-extern "C" {
-#include "aes.h"
-}
+#include "xtsn_core.h"
 
-#if defined _WIN16 || defined _WIN32 || defined _WIN64
-#include <windows.h>
-typedef HMODULE DYHandle;
-#ifdef _WIN64
-#define LIBCRYPTO "libcrypto-1_1-x64.dll"
-#else
-#define LIBCRYPTO "libcrypto-1_1.dll"
-#endif
-#elif defined __linux__ || (defined __APPLE__ && defined __MACH__)
-#include <dlfcn.h>
-typedef void* DYHandle;
-#define WINAPI
-#ifdef __linux__
-#define LIBCRYPTO "libcrypto.so"
-#else
-#define LIBCRYPTO "libcrypto.dylib"
-#endif
-#endif
-
-typedef uint8_t u8;
-typedef uint16_t u16;
-typedef uint32_t u32;
 typedef uint64_t u64;
 
-const static union {
-    u16 foo;
-    u8 islittle;
-} endian = {(u16)0x001};
-
-inline static u64 be64(u64 var) {
-    if(endian.islittle) {
-        #if defined __clang__ || defined __GNUC__
-        var = __builtin_bswap64(var);
-        #elif defined _MSC_VER
-        var = _byteswap_uint64(var);
-        #else
-        u64 tmp = var;
-        ((u8 *) &var)[7] = ((u8 *) &tmp)[0];
-        ((u8 *) &var)[6] = ((u8 *) &tmp)[1];
-        ((u8 *) &var)[5] = ((u8 *) &tmp)[2];
-        ((u8 *) &var)[4] = ((u8 *) &tmp)[3];
-        ((u8 *) &var)[3] = ((u8 *) &tmp)[4];
-        ((u8 *) &var)[2] = ((u8 *) &tmp)[5];
-        ((u8 *) &var)[1] = ((u8 *) &tmp)[6];
-        ((u8 *) &var)[0] = ((u8 *) &tmp)[7];
-        #endif
-    }
-    return var;
-}
-
-inline static u64 le64(u64 var) {
-    if(!endian.islittle) {
-        #if defined __clang__ || defined __GNUC__
-        var = __builtin_bswap64(var);
-        #elif defined _MSC_VER
-        var = _byteswap_uint64(var);
-        #else
-        //sacrifice code size for possible speed up
-        u64 tmp = var;
-        ((u8 *) &var)[7] = ((u8 *) &tmp)[0];
-        ((u8 *) &var)[6] = ((u8 *) &tmp)[1];
-        ((u8 *) &var)[5] = ((u8 *) &tmp)[2];
-        ((u8 *) &var)[4] = ((u8 *) &tmp)[3];
-        ((u8 *) &var)[3] = ((u8 *) &tmp)[4];
-        ((u8 *) &var)[2] = ((u8 *) &tmp)[5];
-        ((u8 *) &var)[1] = ((u8 *) &tmp)[6];
-        ((u8 *) &var)[0] = ((u8 *) &tmp)[7];
-        #endif
-    }
-    return var;
-}
-
-class DynamicHelper {
-    DYHandle handle;
-public:
-    inline bool LoadLib(const char *name) {
-        #if defined _WIN16 || defined _WIN32 || defined _WIN64
-        handle = LoadLibraryExA(name, NULL, LOAD_LIBRARY_SEARCH_DEFAULT_DIRS);
-        #elif defined __linux__ || (defined __APPLE__ && defined __MACH__)
-        handle = dlopen(name, RTLD_NOW);
-        #endif
-        return handle != NULL;
-    }
-    inline void Unload() {
-        if(handle) {
-            #if defined _WIN16 || defined _WIN32 || defined _WIN64
-            FreeLibrary(handle);
-            #elif defined __linux__ || (defined __APPLE__ && defined __MACH__)
-            dlclose(handle);
-            #endif
-            handle = 0;
-        }
-    }
-    inline void GetFunctionPtr(const char* name, void** ptr) {
-        *ptr = NULL;
-        #if defined _WIN16 || defined _WIN32 || defined _WIN64
-        *ptr = (void*)GetProcAddress(handle, name);
-        #elif defined __linux__ || (defined __APPLE__ && defined __MACH__)
-        *ptr = dlsym(handle, name);
-        #endif
-    }
-    inline bool HasHandle() {return handle != NULL;}
-    DynamicHelper() : handle(0) {}
-    ~DynamicHelper() {Unload();}
-};
-
 typedef struct {
     PyObject_HEAD
-    u8 roundkeys_x2[352];
+    xtsn_ctx *ctx;
 } XTSNObject;
 
-class bigint128 {
-public:
-    union {
-        u8 v8[16];
-        u64 v64[2];
-    };
-};
+//a python int, as the two halves of a 128-bit sector number
+typedef struct {
+    u64 lo;
+    u64 hi;
+} SectorOffset;
+
+//negative numbers are taken as 128-bit two's complement
+static int sector_offset_from_pylong(PyObject *o, SectorOffset *p) {
+    long long v;
+    int overflow;
+    if(!PyLong_CheckExact(o)) {
+        PyErr_SetString(PyExc_ValueError, "Not an int was given, convertion to sector offset failed.");
+        return 0;
+    }
+    //real sector numbers fit in 63 bits, which takes no python calls
+    v = PyLong_AsLongLongAndOverflow(o, &overflow);
+    if(!overflow) {
+        if(v == -1 && PyErr_Occurred()) return 0;
+        p->lo = (u64)v;
+        p->hi = v < 0 ? ~0LLU : 0;
+        return 1;
+    }
+    auto _hi = PyObject_CallMethod(o, "__rshift__", "i", 64);
+    if(!_hi) return 0;
+    p->lo = PyLong_AsUnsignedLongLongMask(o);
+    p->hi = PyLong_AsUnsignedLongLongMask(_hi);
+    Py_DECREF(_hi);
 
-class SectorOffset : public bigint128 {
-public:
-    inline u64* Lo() {return &v64[0];}
-    inline u64* Hi() {return &v64[1];}
-    inline void Step() {
-        if (v64[0] > (v64[0] + 1LLU)) v64[1] += 1LLU;
-        v64[0] += 1LLU;
-    }
-    inline void Step(u64 amount) {
-        if (v64[0] > (v64[0] + amount)) v64[1] += 1LLU;
-        v64[0] += amount;
-    }
-    static int FromPyLong(PyObject *o, SectorOffset *p) {
-        if(!PyLong_CheckExact(o)) {
-            PyErr_SetString(PyExc_ValueError, "Not an int was given, convertion to sector offset failed.");
-            return 0;
-        }
-        auto _hi = PyObject_CallMethod(o, "__rshift__", "i", 64);
-        if(!_hi) return 0;
-        *p->Lo() = PyLong_AsUnsignedLongLongMask(o);
-        *p->Hi() = PyLong_AsUnsignedLongLongMask(_hi);
-        Py_DECREF(_hi);
+    return 1;
+}
 
-        return Py_CLEANUP_SUPPORTED;
-    }
-};
+static void set_xtsn_error(int err) {
+    PyObject *type = PyExc_ValueError;
+    if(err == XTSN_ERR_NOMEM) type = PyExc_MemoryError;
+    else if(err == XTSN_ERR_BACKEND) type = PyExc_RuntimeError;
+    PyErr_SetString(type, xtsn_strerror(err));
+}
 
-template<bool (*crypher)(const u8*, const u8*, u8*)>
-class Tweak : public bigint128 {
-public:
-    inline Tweak(SectorOffset& offset, u8 *roundkeys_tweak) {
-        v64[1] = be64(offset.v64[0]);
-        v64[0] = be64(offset.v64[1]);
-        if(!crypher(roundkeys_tweak, v8, v8)) throw false;
+typedef int (*xtsn_crypt)(xtsn_ctx*, void*, const void*, size_t, uint64_t, uint64_t, uint64_t, uint64_t, int);
+
+//crypts len bytes from in into out (in place when in is NULL) with the GIL released. the caller has to make
+//sure the memory stays valid, which a held Py_buffer or a not yet shared bytes object does
+template<xtsn_crypt crypt>
+static bool xtsn_go(XTSNObject *self, void *out, const void *in, Py_ssize_t len, const SectorOffset& sector,
+                    unsigned long long sector_size, unsigned long long skipped_bytes, int threads) {
+    int err;
+    if (!self->ctx) {
+        PyErr_SetString(PyExc_RuntimeError, "XTSN object was not initialized");
+        return false;
     }
-    inline void Update() {
-        int flag = v8[15] & 0x80;
-        v64[1] = le64(le64(v64[1]) << 1) | (le64(v64[0]) >> 63);
-        v64[0] = le64(le64(v64[0]) << 1);
-        if (flag) v8[0] ^= 0x87;
+    Py_BEGIN_ALLOW_THREADS
+    err = crypt(self->ctx, out, in, (size_t)len, sector.lo, sector.hi, sector_size, skipped_bytes, threads);
+    Py_END_ALLOW_THREADS
+    if (err) {
+        set_xtsn_error(err);
+        return false;
     }
+    return true;
+}
+
+//the arguments of decrypt/encrypt, and of their _into versions with out
+struct CryptArgs {
+    PyObject *buf;
+    SectorOffset sector;
+    unsigned long long sector_size;
+    unsigned long long skipped_bytes;
+    int threads;
+    PyObject *out;
+    CryptArgs() : buf(NULL), sector(), sector_size(0x200), skipped_bytes(0), threads(0), out(Py_None) {}
 };
 
-class Buffer {
-public:
-    bigint128* ptr;
-    u64 len;
-    inline Buffer& operator^=(bigint128& tweak) {
-        ptr->v64[0] ^= tweak.v64[0];
-        ptr->v64[1] ^= tweak.v64[1];
-        return *this;
-    }
-    inline void Step() {
-        ptr++;
-        len -= 16LLU;
-    }
+static const char* crypt_keywords[] = {
+    "buf",
+    "sector_off",
+    "sector_size",
+    "skipped_bytes",
+    "threads",
+    "out",
+    NULL,
 };
 
-void *(WINAPI *EVP_CIPHER_CTX_new)() = NULL;
-void *(WINAPI *EVP_aes_128_ecb)() = NULL;
-int (WINAPI *EVP_CipherInit_ex)(void*, void*, void*, const void*, void*, int) = NULL;
-int (WINAPI *EVP_CIPHER_CTX_key_length)(void*) = NULL;
-void (WINAPI *EVP_CIPHER_CTX_set_padding)(void*, int) = NULL;
-int (WINAPI *EVP_CipherUpdate)(void*, void*, int*, const void*, int) = NULL;
-int (WINAPI *EVP_CipherFinal_ex)(void*, void*, int*) = NULL;
-void (WINAPI *EVP_CIPHER_CTX_free)(void*) = NULL;
-unsigned long (WINAPI *OpenSSL_version_num)() = NULL;
-
-static DynamicHelper lcrypto;
-static bool lib_to_load = true;
-
-template<bool encrypt>
-bool openssl_crypt(const u8* key, const u8* data, u8* out) {
-    void *ctx = EVP_CIPHER_CTX_new();
-    if(!ctx) return false;
-    bool ret = false;
-    do {
-        if(!EVP_CipherInit_ex(ctx, EVP_aes_128_ecb(), NULL, key, NULL, (int)encrypt)) break;
-        if(EVP_CIPHER_CTX_key_length(ctx) != 16) break;
-        EVP_CIPHER_CTX_set_padding(ctx, 0);
-        int foo;
-        if(!EVP_CipherUpdate(ctx, out, &foo, data, 16) && !EVP_CipherFinal_ex(ctx, out + foo, &foo)) break;
-        ret = true;
-    } while(0);
-    EVP_CIPHER_CTX_free(ctx);
-    return ret;
+#if PY_VERSION_HEX >= 0x03070000
+//the arguments come as an array with the keyword names in a tuple, so unlike METH_VARARGS no tuple or
+//dict is made per call. small reads are common enough that the parsing was as slow as the crypting
+#define XTSN_METH_FLAGS (METH_FASTCALL | METH_KEYWORDS)
+#define XTSN_METH_ARGS PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames
+#define XTSN_METH_PARSE(with_out, a) parse_crypt_args(args, nargs, kwnames, with_out, a)
+
+static bool parse_ull(PyObject *o, unsigned long long *v) {
+    //like "K", which doesn't check for overflow either
+    if (!PyLong_Check(o)) {
+        PyErr_Format(PyExc_TypeError, "an integer is required (got type %.200s)", Py_TYPE(o)->tp_name);
+        return false;
+    }
+    *v = PyLong_AsUnsignedLongLongMask(o);
+    return !(*v == (unsigned long long)-1 && PyErr_Occurred());
 }
 
-bool aes_decrypt_128_wrap(const u8* roundkey, const u8* data, u8* out) {
-    aes_decrypt_128(roundkey, data, out);
+static bool parse_int(PyObject *o, int *v) {
+    long l = PyLong_AsLong(o);
+    if (l == -1 && PyErr_Occurred())
+        return false;
+    if (l > INT_MAX || l < INT_MIN) {
+        PyErr_SetString(PyExc_OverflowError, "signed integer is out of range for int");
+        return false;
+    }
+    *v = (int)l;
     return true;
 }
 
-bool aes_encrypt_128_wrap(const u8* roundkey, const u8* data, u8* out) {
-    aes_encrypt_128(roundkey, data, out);
-    return true;
-}
+static bool parse_crypt_args(PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames, bool with_out,
+                             CryptArgs *a) {
+    PyObject *objs[6] = {NULL};
+    Py_ssize_t max = with_out ? 6 : 5, nkw = kwnames ? PyTuple_GET_SIZE(kwnames) : 0;
 
-template<bool (*crypher)(const u8*, const u8*, u8*), bool (*crypher2)(const u8*, const u8*, u8*)>
-class XTSN {
-    SectorOffset sectoroffset;
-    Buffer buf;
-    u64 sector_size;
-    u64 skipped_bytes;
-    u8 *roundkeys_key;
-    u8 *roundkeys_tweak;
-    #ifdef DEBUGON
-    void Debug() { //debug printing.
-        PySys_WriteStdout("Sector Offset (Lo, Hi): %llu, %llu\n"
-            "Buffer Length: %llu\n"
-            "Sector Size: %llu\n"
-            "Skipped Bytes: %llu\n\n",
-            (unsigned long long)*sectoroffset.Lo(), (unsigned long long)*sectoroffset.Hi(),
-            (unsigned long long)buf.len,
-            (unsigned long long)sector_size,
-            (unsigned long long)skipped_bytes);
-        fflush(stdout);
-    }
-    #endif
-    void Run() {
-        if(skipped_bytes) {
-            if(skipped_bytes / sector_size) {
-                sectoroffset.Step(skipped_bytes / sector_size);
-                skipped_bytes %= sector_size;
-            }
-            if(skipped_bytes) {
-                Tweak<crypher2> tweak(sectoroffset, roundkeys_tweak);
-                u64 i;
-                for (i = 0; i < (skipped_bytes / 16LLU); i++) {
-                    tweak.Update();
-                }
-                for (i = 0; i < ((sector_size - skipped_bytes) / 16LLU) && buf.len; i++) {
-                    buf ^= tweak;
-                    crypher(roundkeys_key, buf.ptr->v8, buf.ptr->v8);
-                    buf ^= tweak;
-                    tweak.Update();
-                    buf.Step();
-                }
-                sectoroffset.Step();
-            }
+    if (nargs > max) {
+        PyErr_Format(PyExc_TypeError, "function takes at most %zd arguments (%zd given)", max, nargs + nkw);
+        return false;
+    }
+    for (Py_ssize_t i = 0; i < nargs; i++) objs[i] = args[i];
+    for (Py_ssize_t i = 0; i < nkw; i++) {
+        PyObject *name = PyTuple_GET_ITEM(kwnames, i);
+        Py_ssize_t j = 0;
+        while (j < max && PyUnicode_CompareWithASCIIString(name, crypt_keywords[j])) j++;
+        if (j == max) {
+            PyErr_Format(PyExc_TypeError, "'%U' is an invalid keyword argument for this function", name);
+            return false;
         }
-        while(buf.len) {
-            Tweak<crypher2> tweak(sectoroffset, roundkeys_tweak);
-            u64 i;
-            for (i = 0; i < (sector_size / 16LLU) && buf.len; i++) {
-                buf ^= tweak;
-                crypher(roundkeys_key, buf.ptr->v8, buf.ptr->v8);
-                buf ^= tweak;
-                tweak.Update();
-                buf.Step();
-            }
-            sectoroffset.Step();
+        if (objs[j]) {
+            PyErr_Format(PyExc_TypeError, "argument for function given by name ('%s') and position (%zd)",
+                         crypt_keywords[j], j + 1);
+            return false;
         }
+        objs[j] = args[nargs + i];
     }
-public:
-    inline PyObject *PythonRun(XTSNObject *self, PyObject *args, PyObject *kwds) {
-        Py_buffer orig_buf;
-        PyObject *local_buf = NULL;
-
-        static const char* keywords[] = {
-            "buf",
-            "sector_off",
-            "sector_size",
-            "skipped_bytes",
-            NULL,
-        };
-
-        if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*O&|KK", (char**)keywords, &orig_buf,
-           &SectorOffset::FromPyLong, &sectoroffset, &sector_size, &skipped_bytes))
-            return NULL;
-
-        if (orig_buf.len == 0) { //nothing to crypt i guess
-            local_buf = PyBytes_FromStringAndSize((char * ) NULL, 0);
-            if (!local_buf) {
-                PyErr_SetString(PyExc_MemoryError, "Python doesn't have memory for the buffer.");
-            }
-            goto end;
+    for (Py_ssize_t i = 0; i < 2; i++) {
+        if (!objs[i]) {
+            PyErr_Format(PyExc_TypeError, "function missing required argument '%s' (pos %zd)",
+                         crypt_keywords[i], i + 1);
+            return false;
         }
+    }
 
-        if (orig_buf.len % 16) {
-            PyErr_SetString(PyExc_ValueError, "length not divisable by 16");
-            goto end;
-        }
+    a->buf = objs[0];
+    if (!sector_offset_from_pylong(objs[1], &a->sector))
+        return false;
+    if (objs[2] && !parse_ull(objs[2], &a->sector_size))
+        return false;
+    if (objs[3] && !parse_ull(objs[3], &a->skipped_bytes))
+        return false;
+    if (objs[4] && !parse_int(objs[4], &a->threads))
+        return false;
+    if (objs[5])
+        a->out = objs[5];
+    return true;
+}
+#else
+#define XTSN_METH_FLAGS (METH_VARARGS | METH_KEYWORDS)
+#define XTSN_METH_ARGS PyObject *args, PyObject *kwds
+#define XTSN_METH_PARSE(with_out, a) parse_crypt_args(args, kwds, with_out, a)
+
+static bool parse_crypt_args(PyObject *args, PyObject *kwds, bool with_out, CryptArgs *a) {
+    static const char* keywords[] = {"buf", "sector_off", "sector_size", "skipped_bytes", "threads", NULL};
+    if (with_out) {
+        return PyArg_ParseTupleAndKeywords(args, kwds, "OO&|KKiO", (char**)crypt_keywords, &a->buf,
+            &sector_offset_from_pylong, &a->sector, &a->sector_size, &a->skipped_bytes, &a->threads, &a->out);
+    }
+    return PyArg_ParseTupleAndKeywords(args, kwds, "OO&|KKi", (char**)keywords, &a->buf,
+        &sector_offset_from_pylong, &a->sector, &a->sector_size, &a->skipped_bytes, &a->threads);
+}
+#endif
 
-        if (skipped_bytes % 16) {
-            PyErr_SetString(PyExc_ValueError, "skipped bytes not divisable by 16");
-            goto end;
-        }
+template<xtsn_crypt crypt>
+static PyObject *py_xtsn_run(XTSNObject *self, XTSN_METH_ARGS) {
+    Py_buffer orig_buf;
+    PyObject *local_buf = NULL;
+    CryptArgs a;
 
-        if (sector_size % 16 || sector_size == 0) {
-            PyErr_SetString(PyExc_ValueError, sector_size == 0 ? "sector size must not be 0" : "sector size not divisable by 16");
-            goto end;
-        }
+    if (!XTSN_METH_PARSE(false, &a))
+        return NULL;
+    if (PyObject_GetBuffer(a.buf, &orig_buf, PyBUF_SIMPLE) < 0)
+        return NULL;
 
-        local_buf = PyBytes_FromStringAndSize((char * ) orig_buf.buf, orig_buf.len);
+    //crypted straight from the buffer into the new bytes, instead of copying it over first
+    local_buf = PyBytes_FromStringAndSize(NULL, orig_buf.len);
 
-        if (!local_buf) {
-            PyErr_SetString(PyExc_MemoryError, "Python doesn't have memory for the buffer.");
-            goto end;
-        }
+    if (!local_buf) {
+        PyErr_SetString(PyExc_MemoryError, "Python doesn't have memory for the buffer.");
+        goto end;
+    }
 
-        roundkeys_key = self->roundkeys_x2;
-        roundkeys_tweak = self->roundkeys_x2 + 0xB0;
-        buf.ptr = (bigint128 *) PyBytes_AsString(local_buf);
-        buf.len = (u64) orig_buf.len;
-
-        #ifdef DEBUGON
-        Debug();
-        #endif
-        try {
-            Run();
-        } catch(...) {
-            Py_XDECREF(local_buf);
-            local_buf = NULL;
-            PyErr_SetString(PyExc_RuntimeError, "Unexpected error from openssl.");
+    //local_buf isn't visible to anyone else yet, so it's safe to work on without the GIL
+    if (!xtsn_go<crypt>(self, PyBytes_AS_STRING(local_buf), orig_buf.buf, orig_buf.len, a.sector,
+                        a.sector_size, a.skipped_bytes, a.threads)) {
+        Py_XDECREF(local_buf);
+        local_buf = NULL;
+    }
+
+end:
+    PyBuffer_Release(&orig_buf);
+    return local_buf;
+}
+
+//crypts buf in place, or into out when it's given, returning the number of bytes crypted
+template<xtsn_crypt crypt>
+static PyObject *py_xtsn_run_into(XTSNObject *self, XTSN_METH_ARGS) {
+    Py_buffer in_buf, out_buf;
+    PyObject *ret = NULL;
+    CryptArgs a;
+
+    if (!XTSN_METH_PARSE(true, &a))
+        return NULL;
+
+    if (a.out == Py_None) {
+        if (PyObject_GetBuffer(a.buf, &in_buf, PyBUF_WRITABLE) < 0)
+            return NULL;
+        out_buf = in_buf;
+    } else {
+        if (PyObject_GetBuffer(a.buf, &in_buf, PyBUF_SIMPLE) < 0)
+            return NULL;
+        if (PyObject_GetBuffer(a.out, &out_buf, PyBUF_WRITABLE) < 0) {
+            PyBuffer_Release(&in_buf);
+            return NULL;
         }
+    }
 
-    end:
-        PyBuffer_Release(&orig_buf);
-        return local_buf;
+    if (out_buf.len < in_buf.len) {
+        PyErr_SetString(PyExc_ValueError, "out is smaller than buf");
+        goto end;
     }
-    inline XTSN() : sector_size(0x200), skipped_bytes(0) {}
-};
 
-typedef XTSN<&aes_decrypt_128_wrap, aes_encrypt_128_wrap> XTSNDecrypt;
-typedef XTSN<&aes_encrypt_128_wrap, aes_encrypt_128_wrap> XTSNEncrypt;
-typedef XTSN<&openssl_crypt<false>, &openssl_crypt<true>> XTSNOpenSSLDecrypt;
-typedef XTSN<&openssl_crypt<true>, &openssl_crypt<true>> XTSNOpenSSLEncrypt;
+    if (!xtsn_go<crypt>(self, out_buf.buf, in_buf.buf, in_buf.len, a.sector, a.sector_size, a.skipped_bytes,
+                        a.threads))
+        goto end;
+
+    ret = PyLong_FromSsize_t(in_buf.len);
 
-inline static void
-aes_xtsn_schedule_128(u8* key, u8* tweakin, u8* roundkeys_x2) {
-    aes_key_schedule_128(key, roundkeys_x2);
-    aes_key_schedule_128(tweakin, roundkeys_x2 + 0xB0);
+end:
+    if (a.out != Py_None)
+        PyBuffer_Release(&out_buf);
+    PyBuffer_Release(&in_buf);
+    return ret;
 }
 
 // python stuff
 static int XTSN_init(XTSNObject *self, PyObject *args, PyObject *kwds) {
     Py_buffer key, tweak;
-    int ret = -1;
+    const char *backend = NULL;
+    xtsn_ctx *ctx;
+    int ret = -1, err;
 
     static const char* keywords[] = {
         "crypt",
         "tweak",
+        "backend",
         NULL,
     };
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*y*", (char**)keywords, &key, &tweak)) {
+    //the ctx can be in use by a crypt running without the GIL, so it is never swapped out from under it
+    if (self->ctx) {
+        PyErr_SetString(PyExc_RuntimeError, "XTSN object is already initialized");
+        return -1;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*y*|z", (char**)keywords, &key, &tweak, &backend)) {
         return -1;
     }
 
@@ -387,7 +294,17 @@ static int XTSN_init(XTSNObject *self, PyObject *args, PyObject *kwds) {
         goto end;
     }
 
-    aes_xtsn_schedule_128((u8*)key.buf, (u8*)tweak.buf, self->roundkeys_x2);
+    err = xtsn_new((const uint8_t*)key.buf, (const uint8_t*)tweak.buf, &ctx);
+    if (err) {
+        set_xtsn_error(err);
+        goto end;
+    }
+    if (backend && (err = xtsn_ctx_set_backend(ctx, backend))) {
+        xtsn_free(ctx);
+        set_xtsn_error(err);
+        goto end;
+    }
+    self->ctx = ctx;
     ret = 0;
 
 end:
@@ -396,29 +313,55 @@ end:
     return ret;
 }
 
-static PyObject *py_xtsn_decrypt(XTSNObject *self, PyObject *args, PyObject *kwds) {
-    XTSNDecrypt xtsn;
-    return xtsn.PythonRun(self, args, kwds);
+static void XTSN_dealloc(XTSNObject *self) {
+    xtsn_free(self->ctx);
+    Py_TYPE(self)->tp_free((PyObject *) self);
 }
 
-static PyObject *py_xtsn_encrypt(XTSNObject *self, PyObject *args, PyObject *kwds) {
-    XTSNEncrypt xtsn;
-    return xtsn.PythonRun(self, args, kwds);
+static PyObject *XTSN_get_backend(XTSNObject *self, void *closure) {
+    if (!self->ctx) {
+        PyErr_SetString(PyExc_RuntimeError, "XTSN object was not initialized");
+        return NULL;
+    }
+    return PyUnicode_FromString(xtsn_ctx_backend(self->ctx));
 }
 
-static PyObject *py_xtsn_openssl_decrypt(XTSNObject *self, PyObject *args, PyObject *kwds) {
-    XTSNOpenSSLDecrypt xtsn;
-    return xtsn.PythonRun(self, args, kwds);
+//None goes back to following set_backend
+static int XTSN_set_backend(XTSNObject *self, PyObject *value, void *closure) {
+    const char *name = NULL;
+    int err;
+    if (!self->ctx) {
+        PyErr_SetString(PyExc_RuntimeError, "XTSN object was not initialized");
+        return -1;
+    }
+    if (!value) {
+        PyErr_SetString(PyExc_TypeError, "can't delete backend");
+        return -1;
+    }
+    if (value != Py_None && !(name = PyUnicode_AsUTF8(value)))
+        return -1;
+    if ((err = xtsn_ctx_set_backend(self->ctx, name))) {
+        set_xtsn_error(err);
+        return -1;
+    }
+    return 0;
 }
 
-static PyObject *py_xtsn_openssl_encrypt(XTSNObject *self, PyObject *args, PyObject *kwds) {
-    XTSNOpenSSLEncrypt xtsn;
-    return xtsn.PythonRun(self, args, kwds);
-}
+static PyGetSetDef XTSN_getset[] = {
+    {"backend", (getter) XTSN_get_backend, (setter) XTSN_set_backend,
+        "Backend this object crypts with. Set to None to use the one from set_backend.", NULL},
+    {NULL}
+};
 
 static PyMethodDef XTSN_methods[] = {
-    {"decrypt", (PyCFunction) py_xtsn_decrypt, METH_VARARGS | METH_KEYWORDS, "Decrypt AES-XTSN content."},
-    {"encrypt", (PyCFunction) py_xtsn_encrypt, METH_VARARGS | METH_KEYWORDS, "Encrypt AES-XTSN content."},
+    {"decrypt", (PyCFunction) (void(*)(void)) py_xtsn_run<xtsn_decrypt>, XTSN_METH_FLAGS,
+        "Decrypt AES-XTSN content."},
+    {"encrypt", (PyCFunction) (void(*)(void)) py_xtsn_run<xtsn_encrypt>, XTSN_METH_FLAGS,
+        "Encrypt AES-XTSN content."},
+    {"decrypt_into", (PyCFunction) (void(*)(void)) py_xtsn_run_into<xtsn_decrypt>, XTSN_METH_FLAGS,
+        "Decrypt AES-XTSN content in place, or into out."},
+    {"encrypt_into", (PyCFunction) (void(*)(void)) py_xtsn_run_into<xtsn_encrypt>, XTSN_METH_FLAGS,
+        "Encrypt AES-XTSN content in place, or into out."},
     {NULL}
 };
 
@@ -431,72 +374,514 @@ public:
         tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE;
         tp_doc = "Nintendo AES-XTSN";
         tp_methods = XTSN_methods;
+        tp_getset = XTSN_getset;
         tp_init = (initproc) XTSN_init;
+        tp_dealloc = (destructor) XTSN_dealloc;
         tp_new = PyType_GenericNew;
     }
 } XTSNType;
 
-static void unload_lcrypto(void* unused) {
-    (void)unused;
-    if(!lib_to_load) {
-        XTSN_methods[0].ml_meth = (PyCFunction)py_xtsn_decrypt;
-        XTSN_methods[1].ml_meth = (PyCFunction)py_xtsn_encrypt;
-        lcrypto.Unload();
-        lib_to_load = true;
+//decrypted sectors for the mounts, kept as the bytes objects they were put in as,
+//so a hit is handed out without a copy. only used with the GIL held
+class SectorCache {
+    struct Key {
+        u64 part;
+        u64 sector;
+        bool operator==(const Key& o) const {return part == o.part && sector == o.sector;}
+    };
+    struct KeyHash {
+        size_t operator()(const Key& k) const {return (size_t)(k.sector * 0x9E3779B97F4A7C15LLU ^ k.part);}
+    };
+    typedef std::list<std::pair<Key, PyObject*>> List;
+    List lru; //most recently used first
+    std::unordered_map<Key, List::iterator, KeyHash> map;
+    void Remove(std::unordered_map<Key, List::iterator, KeyHash>::iterator it) {
+        PyObject *data = it->second->second;
+        used_bytes -= (u64)PyBytes_GET_SIZE(data);
+        lru.erase(it->second);
+        map.erase(it);
+        Py_DECREF(data);
+    }
+public:
+    u64 max_bytes;
+    u64 used_bytes;
+    u64 hits;
+    u64 misses;
+    //returns a new reference, or NULL without an error set when it's not cached
+    PyObject *Get(u64 part, u64 sector) {
+        auto it = map.find(Key{part, sector});
+        if(it == map.end()) {
+            misses++;
+            return NULL;
+        }
+        hits++;
+        lru.splice(lru.begin(), lru, it->second);
+        Py_INCREF(it->second->second);
+        return it->second->second;
+    }
+    //data has to be a bytes object
+    void Put(u64 part, u64 sector, PyObject *data) {
+        Key key{part, sector};
+        auto it = map.find(key);
+        if(it != map.end()) Remove(it);
+        u64 size = (u64)PyBytes_GET_SIZE(data);
+        if(size > max_bytes) return;
+        while(used_bytes + size > max_bytes) Remove(map.find(lru.back().first));
+        Py_INCREF(data);
+        lru.emplace_front(key, data);
+        map[key] = lru.begin();
+        used_bytes += size;
+    }
+    void Invalidate(u64 part, u64 sector, u64 count) {
+        //whichever is smaller to walk, the range or everything cached
+        if(count > map.size()) {
+            for (auto it = map.begin(); it != map.end();) {
+                auto next = std::next(it);
+                if(it->first.part == part && it->first.sector - sector < count) Remove(it);
+                it = next;
+            }
+        } else {
+            for (u64 i = 0; i < count; i++) {
+                auto it = map.find(Key{part, sector + i});
+                if(it != map.end()) Remove(it);
+            }
+        }
+    }
+    void Clear() {
+        while(!map.empty()) Remove(map.begin());
     }
+    SectorCache(u64 max_bytes) : max_bytes(max_bytes), used_bytes(0), hits(0), misses(0) {}
+    ~SectorCache() {Clear();}
+};
+
+typedef struct {
+    PyObject_HEAD
+    SectorCache *cache;
+} SectorCacheObject;
+
+static int SectorCache_init(SectorCacheObject *self, PyObject *args, PyObject *kwds) {
+    unsigned long long max_bytes;
+
+    static const char* keywords[] = {
+        "max_bytes",
+        NULL,
+    };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "K", (char**)keywords, &max_bytes))
+        return -1;
+
+    delete self->cache;
+    if(!(self->cache = new (std::nothrow) SectorCache(max_bytes))) {
+        PyErr_SetString(PyExc_MemoryError, "Couldn't allocate the sector cache.");
+        return -1;
+    }
+    return 0;
 }
 
-static void load_lcrypto() {
-    if(!lib_to_load) return;
-    lib_to_load = false;
-    if(!lcrypto.LoadLib(LIBCRYPTO)) return;
-    lcrypto.GetFunctionPtr("EVP_CIPHER_CTX_new", (void**)&EVP_CIPHER_CTX_new);
-    lcrypto.GetFunctionPtr("EVP_aes_128_ecb", (void**)&EVP_aes_128_ecb);
-    lcrypto.GetFunctionPtr("EVP_CipherInit_ex", (void**)&EVP_CipherInit_ex);
-    lcrypto.GetFunctionPtr("EVP_CIPHER_CTX_key_length", (void**)&EVP_CIPHER_CTX_key_length);
-    lcrypto.GetFunctionPtr("EVP_CIPHER_CTX_set_padding", (void**)&EVP_CIPHER_CTX_set_padding);
-    lcrypto.GetFunctionPtr("EVP_CipherUpdate", (void**)&EVP_CipherUpdate);
-    lcrypto.GetFunctionPtr("EVP_CipherFinal_ex", (void**)&EVP_CipherFinal_ex);
-    lcrypto.GetFunctionPtr("EVP_CIPHER_CTX_free", (void**)&EVP_CIPHER_CTX_free);
-    lcrypto.GetFunctionPtr("OpenSSL_version_num", (void**)&OpenSSL_version_num);
+static void SectorCache_dealloc(SectorCacheObject *self) {
+    delete self->cache;
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
 
-    if(!EVP_CIPHER_CTX_new || !EVP_aes_128_ecb || !EVP_CipherInit_ex ||
-      !EVP_CIPHER_CTX_key_length || !EVP_CIPHER_CTX_set_padding ||
-      !EVP_CipherUpdate || !EVP_CipherFinal_ex || !EVP_CIPHER_CTX_free ||
-      !OpenSSL_version_num) {
-        lcrypto.Unload();
-        return;
+static bool SectorCache_check(SectorCacheObject *self) {
+    if(!self->cache) PyErr_SetString(PyExc_RuntimeError, "SectorCache object was not initialized");
+    return self->cache != NULL;
+}
+
+static PyObject *py_sectorcache_get(SectorCacheObject *self, PyObject *args) {
+    unsigned long long part, sector;
+    if (!PyArg_ParseTuple(args, "KK", &part, &sector) || !SectorCache_check(self))
+        return NULL;
+    PyObject *data = self->cache->Get(part, sector);
+    if(!data) Py_RETURN_NONE;
+    return data;
+}
+
+static PyObject *py_sectorcache_put(SectorCacheObject *self, PyObject *args) {
+    unsigned long long part, sector;
+    PyObject *data;
+    if (!PyArg_ParseTuple(args, "KKO", &part, &sector, &data) || !SectorCache_check(self))
+        return NULL;
+    //anything else is copied once, so it can't change under the cache
+    data = PyBytes_CheckExact(data) ? (Py_INCREF(data), data) : PyBytes_FromObject(data);
+    if(!data) return NULL;
+    self->cache->Put(part, sector, data);
+    Py_DECREF(data);
+    Py_RETURN_NONE;
+}
+
+static PyObject *py_sectorcache_invalidate(SectorCacheObject *self, PyObject *args) {
+    unsigned long long part, sector, count = 1;
+    if (!PyArg_ParseTuple(args, "KK|K", &part, &sector, &count) || !SectorCache_check(self))
+        return NULL;
+    self->cache->Invalidate(part, sector, count);
+    Py_RETURN_NONE;
+}
+
+static PyObject *py_sectorcache_clear(SectorCacheObject *self, PyObject *unused) {
+    if (!SectorCache_check(self))
+        return NULL;
+    self->cache->Clear();
+    Py_RETURN_NONE;
+}
+
+static PyObject *py_sectorcache_stats(SectorCacheObject *self, PyObject *unused) {
+    if (!SectorCache_check(self))
+        return NULL;
+    return Py_BuildValue("{sKsKsKsK}", "max_bytes", (unsigned long long)self->cache->max_bytes,
+                         "used_bytes", (unsigned long long)self->cache->used_bytes,
+                         "hits", (unsigned long long)self->cache->hits,
+                         "misses", (unsigned long long)self->cache->misses);
+}
+
+static PyMethodDef SectorCache_methods[] = {
+    {"get", (PyCFunction) py_sectorcache_get, METH_VARARGS, "Get a cached sector, or None."},
+    {"put", (PyCFunction) py_sectorcache_put, METH_VARARGS, "Cache a sector, evicting the least recently used ones."},
+    {"invalidate", (PyCFunction) py_sectorcache_invalidate, METH_VARARGS, "Drop count sectors starting at sector."},
+    {"clear", (PyCFunction) py_sectorcache_clear, METH_NOARGS, "Drop all sectors."},
+    {"stats", (PyCFunction) py_sectorcache_stats, METH_NOARGS, "Get the size and hit counters."},
+    {NULL}
+};
+
+static class SectorCacheType_PyTypeObject : public PyTypeObject {
+public:
+    SectorCacheType_PyTypeObject() : PyTypeObject({PyVarObject_HEAD_INIT(NULL, 0)}) {
+        tp_name = "crypto.SectorCache";
+        tp_basicsize = sizeof(SectorCacheObject);
+        tp_itemsize = 0;
+        tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE;
+        tp_doc = "LRU cache of decrypted sectors, keyed by partition and sector";
+        tp_methods = SectorCache_methods;
+        tp_init = (initproc) SectorCache_init;
+        tp_dealloc = (destructor) SectorCache_dealloc;
+        tp_new = PyType_GenericNew;
+    }
+} SectorCacheType;
+
+typedef struct {
+    PyObject_HEAD
+    xtsn_reader *reader;
+} ImageReaderObject;
+
+static int ImageReader_init(ImageReaderObject *self, PyObject *args, PyObject *kwds) {
+    int fd, depth = 0, engine, err;
+    const char *name = "auto";
+    xtsn_reader *reader;
+
+    static const char* keywords[] = {
+        "fd",
+        "engine",
+        "depth",
+        NULL,
+    };
+
+    //same as XTSN, a read without the GIL can be using the reader
+    if (self->reader) {
+        PyErr_SetString(PyExc_RuntimeError, "ImageReader object is already initialized");
+        return -1;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "i|si", (char**)keywords, &fd, &name, &depth))
+        return -1;
+
+    if (!strcmp(name, "auto")) engine = XTSN_IO_AUTO;
+    else if (!strcmp(name, "pread")) engine = XTSN_IO_PREAD;
+    else if (!strcmp(name, "io_uring")) engine = XTSN_IO_URING;
+    else {
+        PyErr_Format(PyExc_ValueError, "unknown engine '%s'", name);
+        return -1;
+    }
+    if (depth < 0) {
+        PyErr_SetString(PyExc_ValueError, "depth can't be negative");
+        return -1;
+    }
+
+    if ((err = xtsn_reader_new(fd, engine, depth, &reader))) {
+        if (err == XTSN_ERR_UNAVAILABLE)
+            PyErr_SetString(PyExc_OSError, "io_uring is not available on this system");
+        else
+            set_xtsn_error(err);
+        return -1;
+    }
+    self->reader = reader;
+    return 0;
+}
+
+static void ImageReader_dealloc(ImageReaderObject *self) {
+    xtsn_reader_free(self->reader);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static bool ImageReader_check(ImageReaderObject *self) {
+    if(!self->reader) PyErr_SetString(PyExc_RuntimeError, "ImageReader object was not initialized");
+    return self->reader != NULL;
+}
+
+static PyObject *ImageReader_get_engine(ImageReaderObject *self, void *closure) {
+    if (!ImageReader_check(self))
+        return NULL;
+    return PyUnicode_FromString(xtsn_reader_engine(self->reader));
+}
+
+//reads into buf and decrypts it there with the GIL released, returning how many bytes are ready
+static PyObject *py_imagereader_read_decrypt(ImageReaderObject *self, PyObject *args, PyObject *kwds) {
+    static const char* keywords[] = {"offset", "buf", "xtsn", "sector_offset", "sector_size", "skipped_bytes", NULL};
+    unsigned long long offset, sector_size = 0x200, skipped_bytes = 0;
+    SectorOffset sector = {0, 0};
+    PyObject *xtsn = Py_None, *ret = NULL;
+    xtsn_ctx *ctx = NULL;
+    Py_buffer buf;
+    size_t got = 0;
+    int err;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Kw*|OO&KK", (char**)keywords, &offset, &buf, &xtsn,
+                                     &sector_offset_from_pylong, &sector, &sector_size, &skipped_bytes))
+        return NULL;
+    if (!ImageReader_check(self))
+        goto end;
+    if (xtsn != Py_None) {
+        if (!PyObject_TypeCheck(xtsn, &XTSNType)) {
+            PyErr_SetString(PyExc_TypeError, "xtsn must be an XTSN object or None");
+            goto end;
+        }
+        if (!(ctx = ((XTSNObject*)xtsn)->ctx)) {
+            PyErr_SetString(PyExc_RuntimeError, "XTSN object was not initialized");
+            goto end;
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    err = xtsn_read_decrypt(self->reader, ctx, buf.buf, (size_t)buf.len, offset, sector.lo, sector.hi, sector_size,
+                            skipped_bytes, &got);
+    Py_END_ALLOW_THREADS
+    if (err == XTSN_ERR_IO)
+        PyErr_SetFromErrno(PyExc_OSError);
+    else if (err)
+        set_xtsn_error(err);
+    else
+        ret = PyLong_FromSize_t(got);
+
+end:
+    PyBuffer_Release(&buf);
+    return ret;
+}
+
+static PyGetSetDef ImageReader_getset[] = {
+    {"engine", (getter) ImageReader_get_engine, NULL, "Engine this reader ended up with, io_uring or pread.", NULL},
+    {NULL}
+};
+
+static PyMethodDef ImageReader_methods[] = {
+    {"read_decrypt", (PyCFunction) (void(*)(void)) py_imagereader_read_decrypt, METH_VARARGS | METH_KEYWORDS,
+        "Read into buf from offset and decrypt it in place with xtsn, or only read if it's None."},
+    {NULL}
+};
+
+static class ImageReaderType_PyTypeObject : public PyTypeObject {
+public:
+    ImageReaderType_PyTypeObject() : PyTypeObject({PyVarObject_HEAD_INIT(NULL, 0)}) {
+        tp_name = "crypto.ImageReader";
+        tp_basicsize = sizeof(ImageReaderObject);
+        tp_itemsize = 0;
+        tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE;
+        tp_doc = "Reads from a file descriptor with io_uring or pread, decrypting as the data arrives";
+        tp_methods = ImageReader_methods;
+        tp_getset = ImageReader_getset;
+        tp_init = (initproc) ImageReader_init;
+        tp_dealloc = (destructor) ImageReader_dealloc;
+        tp_new = PyType_GenericNew;
     }
+} ImageReaderType;
 
-    //check at bare minimum, 1.1, any variant
-    if(OpenSSL_version_num() < 0x10100000LU) {
-        lcrypto.Unload();
-        PySys_WriteStderr("Found openssl lib, but below version 1.1.\nNot using\n");
-        return;
+static PyObject *py_set_threads(PyObject *self, PyObject *args) {
+    int threads;
+    if (!PyArg_ParseTuple(args, "i", &threads))
+        return NULL;
+    if (threads < 1) {
+        PyErr_SetString(PyExc_ValueError, "threads must be at least 1");
+        return NULL;
     }
+    xtsn_set_threads(threads);
+    Py_RETURN_NONE;
+}
+
+static PyObject *py_get_threads(PyObject *self, PyObject *unused) {
+    return PyLong_FromLong(xtsn_get_threads());
+}
+
+static PyObject *py_set_constant_time(PyObject *self, PyObject *args) {
+    int enable;
+    if (!PyArg_ParseTuple(args, "p", &enable))
+        return NULL;
+    xtsn_set_constant_time(enable);
+    Py_RETURN_NONE;
+}
+
+static PyObject *py_get_constant_time(PyObject *self, PyObject *unused) {
+    return PyBool_FromLong(xtsn_get_constant_time());
+}
+
+static PyObject *py_backends(PyObject *self, PyObject *unused) {
+    xtsn_backend_info info[16];
+    PyObject *list, *item;
+    int count = xtsn_backends(info, 16);
+    if (count > 16) count = 16;
+    if (!(list = PyList_New(count)))
+        return NULL;
+    for (int i = 0; i < count; i++) {
+        item = Py_BuildValue("{s:s,s:s,s:i,s:i,s:i,s:O,s:O}",
+                             "name", info[i].name,
+                             "simd", info[i].simd,
+                             "vector_bits", info[i].vector_bits,
+                             "parallel_blocks", info[i].parallel_blocks,
+                             "batch_blocks", info[i].batch_blocks,
+                             "constant_time", info[i].constant_time ? Py_True : Py_False,
+                             "available", info[i].available ? Py_True : Py_False);
+        if (!item) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+    return list;
+}
+
+static PyObject *py_set_backend(PyObject *self, PyObject *args) {
+    const char *name = NULL;
+    int err;
+    if (!PyArg_ParseTuple(args, "|z", &name))
+        return NULL;
+    if ((err = xtsn_set_backend(name))) {
+        set_xtsn_error(err);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
 
-    XTSN_methods[0].ml_meth = (PyCFunction)py_xtsn_openssl_decrypt;
-    XTSN_methods[1].ml_meth = (PyCFunction)py_xtsn_openssl_encrypt;
-    PySys_WriteStdout("Found and using openssl lib.\n");
+static PyObject *py_get_backend(PyObject *self, PyObject *unused) {
+    return PyUnicode_FromString(xtsn_backend());
 }
 
+static PyObject *py_stats(PyObject *self, PyObject *unused) {
+    xtsn_backend_info info[16];
+    xtsn_backend_stats backend_stats[16];
+    xtsn_stats stats;
+    PyObject *ret, *backends, *item;
+    int count = xtsn_backends(info, 16);
+    xtsn_get_stats(&stats, backend_stats, 16);
+    if (count > 16) count = 16;
+
+    if (!(backends = PyDict_New()))
+        return NULL;
+    for (int i = 0; i < count; i++) {
+        item = Py_BuildValue("{s:K,s:K,s:K,s:K,s:K}",
+                             "decrypt_calls", (unsigned long long)backend_stats[i].decrypt_calls,
+                             "decrypt_bytes", (unsigned long long)backend_stats[i].decrypt_bytes,
+                             "encrypt_calls", (unsigned long long)backend_stats[i].encrypt_calls,
+                             "encrypt_bytes", (unsigned long long)backend_stats[i].encrypt_bytes,
+                             "ns", (unsigned long long)backend_stats[i].ns);
+        if (!item || PyDict_SetItemString(backends, info[i].name, item) < 0) {
+            Py_XDECREF(item);
+            Py_DECREF(backends);
+            return NULL;
+        }
+        Py_DECREF(item);
+    }
+    ret = Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:N}",
+                        "tweak_aes", (unsigned long long)stats.tweak_aes,
+                        "tweak_cache_hits", (unsigned long long)stats.tweak_cache_hits,
+                        "seek_blocks", (unsigned long long)stats.seek_blocks,
+                        "runs", (unsigned long long)stats.runs,
+                        "run_ns", (unsigned long long)stats.run_ns,
+                        "split_calls", (unsigned long long)stats.split_calls,
+                        "errors", (unsigned long long)stats.errors,
+                        "backends", backends);
+    return ret;
+}
+
+static PyObject *py_reset_stats(PyObject *self, PyObject *unused) {
+    xtsn_reset_stats();
+    Py_RETURN_NONE;
+}
+
+//the allocation bitmap of a buffer and how many of its sectors have data
+static PyObject *py_zero_map(PyObject *self, PyObject *args, PyObject *kwds) {
+    static const char* keywords[] = {"buf", "sector_size", NULL};
+    Py_buffer buf;
+    Py_ssize_t sector_size = 0x200;
+    PyObject *map = NULL, *ret = NULL;
+    size_t used;
+    int err;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|n", (char**)keywords, &buf, &sector_size))
+        return NULL;
+    if (sector_size <= 0) {
+        set_xtsn_error(XTSN_ERR_SECTOR_SIZE_ZERO);
+        goto end;
+    }
+    map = PyBytes_FromStringAndSize(NULL, (buf.len / sector_size + (buf.len % sector_size != 0) + 7) / 8);
+    if (!map)
+        goto end;
+
+    Py_BEGIN_ALLOW_THREADS
+    err = xtsn_zero_map(buf.buf, (size_t)buf.len, (size_t)sector_size, (uint8_t*)PyBytes_AS_STRING(map), &used);
+    Py_END_ALLOW_THREADS
+    if (err) {
+        set_xtsn_error(err);
+        goto end;
+    }
+    ret = Py_BuildValue("On", map, (Py_ssize_t)used);
+
+end:
+    Py_XDECREF(map);
+    PyBuffer_Release(&buf);
+    return ret;
+}
+
+static void unload_ccrypto(void *unused) {
+    (void)unused;
+    xtsn_cleanup();
+}
+
+static PyMethodDef ccrypto_methods[] = {
+    {"set_threads", (PyCFunction) py_set_threads, METH_VARARGS, "Set how many threads XTSN uses by default for large buffers."},
+    {"get_threads", (PyCFunction) py_get_threads, METH_NOARGS, "Get how many threads XTSN uses by default for large buffers."},
+    {"set_constant_time", (PyCFunction) py_set_constant_time, METH_VARARGS,
+        "Without AES instructions, use the bitsliced AES instead of table lookups or OpenSSL."},
+    {"get_constant_time", (PyCFunction) py_get_constant_time, METH_NOARGS,
+        "Check if XTSN runs without secret dependent memory accesses."},
+    {"backends", (PyCFunction) py_backends, METH_NOARGS, "List the XTSN backends in this build, fastest first."},
+    {"set_backend", (PyCFunction) py_set_backend, METH_VARARGS,
+        "Select the backend XTSN objects use by default, or None for the fastest available."},
+    {"get_backend", (PyCFunction) py_get_backend, METH_NOARGS, "Get the backend XTSN objects use by default."},
+    {"stats", (PyCFunction) py_stats, METH_NOARGS, "Get the XTSN call, byte, tweak and time counters."},
+    {"reset_stats", (PyCFunction) py_reset_stats, METH_NOARGS, "Set the XTSN counters back to zero."},
+    {"zero_map", (PyCFunction) (void(*)(void)) py_zero_map, METH_VARARGS | METH_KEYWORDS,
+        "Get a bitmap of the sectors of buf that aren't all zero, lowest bit first, and how many there are."},
+    {NULL}
+};
+
 static struct PyModuleDef ccrypto_module = {
     PyModuleDef_HEAD_INIT,
     "ccrypto",
     NULL,
     -1,
+    ccrypto_methods,
     NULL,
     NULL,
     NULL,
-    NULL,
-    unload_lcrypto,
+    unload_ccrypto,
 };
 
 PyMODINIT_FUNC PyInit_ccrypto(void) {
-    load_lcrypto();
     PyObject *m;
+    xtsn_init();
     if (PyType_Ready(&XTSNType) < 0)
         return NULL;
+    if (PyType_Ready(&SectorCacheType) < 0)
+        return NULL;
+    if (PyType_Ready(&ImageReaderType) < 0)
+        return NULL;
 
     m = PyModule_Create(&ccrypto_module);
     if (m == NULL)
@@ -504,5 +889,9 @@ PyMODINIT_FUNC PyInit_ccrypto(void) {
 
     Py_INCREF(&XTSNType);
     PyModule_AddObject(m, "XTSN", (PyObject *) &XTSNType);
+    Py_INCREF(&SectorCacheType);
+    PyModule_AddObject(m, "SectorCache", (PyObject *) &SectorCacheType);
+    Py_INCREF(&ImageReaderType);
+    PyModule_AddObject(m, "ImageReader", (PyObject *) &ImageReaderType);
     return m;
 }
@@ -1,8 +1,59 @@
+from typing import Dict, List, Optional, Tuple, Union
+
 class XTSN:
-	def __init__(self, crypt: bytes, tweak: bytes): ...
+	backend: str
+
+	def __init__(self, crypt: bytes, tweak: bytes, backend: 'Optional[str]' = None): ...
 
 	def decrypt(self, buf: bytes, sector_offset: int, sector_size: int = 0x200,
-		skipped_bytes: int = 0) -> bytes: ...
+		skipped_bytes: int = 0, threads: int = 0) -> bytes: ...
 
 	def encrypt(self, buf: bytes, sector_offset: int, sector_size: int = 0x200,
-		skipped_bytes: int = 0) -> bytes: ...
+		skipped_bytes: int = 0, threads: int = 0) -> bytes: ...
+
+	def decrypt_into(self, buf, sector_offset: int, sector_size: int = 0x200,
+		skipped_bytes: int = 0, threads: int = 0, out=None) -> int: ...
+
+	def encrypt_into(self, buf, sector_offset: int, sector_size: int = 0x200,
+		skipped_bytes: int = 0, threads: int = 0, out=None) -> int: ...
+
+class SectorCache:
+	def __init__(self, max_bytes: int): ...
+
+	def get(self, part: int, sector: int) -> 'Optional[bytes]': ...
+
+	def put(self, part: int, sector: int, data: bytes) -> None: ...
+
+	def invalidate(self, part: int, sector: int, count: int = 1) -> None: ...
+
+	def clear(self) -> None: ...
+
+	def stats(self) -> 'Dict[str, int]': ...
+
+class ImageReader:
+	engine: str
+
+	def __init__(self, fd: int, engine: str = 'auto', depth: int = 0): ...
+
+	def read_decrypt(self, offset: int, buf, xtsn: 'Optional[XTSN]' = None, sector_offset: int = 0,
+		sector_size: int = 0x200, skipped_bytes: int = 0) -> int: ...
+
+def set_threads(threads: int) -> None: ...
+
+def get_threads() -> int: ...
+
+def set_constant_time(enable: bool) -> None: ...
+
+def get_constant_time() -> bool: ...
+
+def backends() -> 'List[Dict[str, Union[str, int, bool]]]': ...
+
+def set_backend(name: 'Optional[str]' = None) -> None: ...
+
+def get_backend() -> str: ...
+
+def stats() -> 'Dict[str, Union[int, Dict[str, Dict[str, int]]]]': ...
+
+def reset_stats() -> None: ...
+
+def zero_map(buf, sector_size: int = 0x200) -> 'Tuple[bytes, int]': ...
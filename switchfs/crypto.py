@@ -6,10 +6,10 @@ if TYPE_CHECKING:
 
 try:
     # noinspection PyProtectedMember
-    from .ccrypto import XTSN
+    from .ccrypto import XTSN, SectorCache, ImageReader, stats, zero_map
 except ImportError:
     try:
-        from ccrypto import XTSN
+        from ccrypto import XTSN, SectorCache, ImageReader, stats, zero_map
     except ImportError:
         exit("Couldn't load ccrypto. The extension needs to be compiled.")
 
@@ -0,0 +1,292 @@
+"""
+Read-only index of a FAT32 file system: the directory tree, with every file's clusters as extents
+(runs of consecutive clusters), so reading a file goes straight to the partition without the FAT.
+"""
+
+import json
+import os
+from array import array
+from bisect import bisect_right
+from calendar import timegm
+from sys import byteorder
+from typing import TYPE_CHECKING
+
+if TYPE_CHECKING:
+    from typing import Callable, Dict, List, Optional, Tuple
+
+# bumped when the cached format changes
+index_version = 2
+
+
+class FAT32Error(ValueError):
+    pass
+
+
+class FATNode:
+    """A file or directory. extents are (offset in the partition, length) in file order."""
+
+    __slots__ = ('name', 'is_dir', 'size', 'mtime', 'extents', 'children', '_starts')
+
+    def __init__(self, name: str, is_dir: bool, size: int = 0, mtime: int = 0,
+                 extents: 'List[Tuple[int, int]]' = None, children: 'Dict[str, FATNode]' = None):
+        self.name = name
+        self.is_dir = is_dir
+        self.size = size
+        self.mtime = mtime
+        self.extents = extents or []
+        # lowercase name: node, lookups are case insensitive like FAT itself
+        self.children = children if children is not None else ({} if is_dir else None)
+        # offset in the file where each extent starts, made the first time it's read
+        self._starts: Optional[List[int]] = None
+
+    def spans(self, offset: int, size: int) -> 'List[Tuple[int, int]]':
+        """(offset in the partition, length) of each piece of the size bytes of the file from offset."""
+        size = min(size, self.size - offset)
+        if size <= 0 or not self.extents:
+            return []
+        if self._starts is None:
+            starts = [0]
+            for _, length in self.extents[:-1]:
+                starts.append(starts[-1] + length)
+            self._starts = starts
+        spans = []
+        i = bisect_right(self._starts, offset) - 1
+        while size > 0 and i < len(self.extents):
+            ext_offset, length = self.extents[i]
+            start = offset - self._starts[i]
+            n = min(length - start, size)
+            spans.append((ext_offset + start, n))
+            offset += n
+            size -= n
+            i += 1
+        return spans
+
+    def to_list(self) -> list:
+        return [self.name, int(self.is_dir), self.size, self.mtime, [x for e in self.extents for x in e],
+                [c.to_list() for c in self.children.values()] if self.is_dir else None]
+
+    @classmethod
+    def from_list(cls, data: list) -> 'FATNode':
+        name, is_dir, size, mtime, extents, children = data
+        node = cls(name, bool(is_dir), size, mtime, list(zip(extents[0::2], extents[1::2])))
+        if is_dir:
+            for c in children:
+                child = cls.from_list(c)
+                node.children[child.name.lower()] = child
+        return node
+
+
+def _dos_time(time: int, date: int) -> int:
+    # local time on the console, taken as UTC so it shows the same everywhere
+    try:
+        return timegm((1980 + (date >> 9), max((date >> 5) & 0xF, 1), max(date & 0x1F, 1),
+                       time >> 11, (time >> 5) & 0x3F, (time & 0x1F) * 2, 0, 0, 0))
+    except (ValueError, OverflowError):
+        return 0
+
+
+def _lfn_checksum(short_name: bytes) -> int:
+    s = 0
+    for c in short_name:
+        s = (((s & 1) << 7) + (s >> 1) + c) & 0xFF
+    return s
+
+
+class FAT32Index:
+    """
+    Built once by walking every directory from the root, reading through read(offset, size), which
+    gives the decrypted partition.
+    """
+
+    def __init__(self, root: FATNode, cluster_size: int, data_start: int,
+                 dir_extents: 'List[Tuple[int, int]]'):
+        self.root = root
+        self.cluster_size = cluster_size
+        # everything before this is the boot sector, reserved sectors and FATs
+        self.data_start = data_start
+        # where the directories are, sorted, so a write can tell if it changes the tree
+        self.dir_extents = sorted(dir_extents)
+        self._dir_starts = [o for o, _ in self.dir_extents]
+
+    def touches_metadata(self, offset: int, size: int) -> bool:
+        """If a write of size bytes at offset in the partition hits the FATs or a directory."""
+        if offset < self.data_start:
+            return True
+        # extents don't overlap, so only the last one starting before the write ends can reach into it
+        i = bisect_right(self._dir_starts, offset + size - 1) - 1
+        return i >= 0 and sum(self.dir_extents[i]) > offset
+
+    def lookup(self, parts: 'List[str]') -> 'Optional[FATNode]':
+        """The node at a path given as its lowercase components, or None."""
+        node = self.root
+        for p in parts:
+            if not node.is_dir:
+                return None
+            node = node.children.get(p)
+            if node is None:
+                return None
+        return node
+
+    @classmethod
+    def build(cls, read: 'Callable[[int, int], bytes]') -> 'FAT32Index':
+        boot = read(0, 0x200)
+        if len(boot) < 0x200 or boot[0x1FE:0x200] != b'\x55\xAA':
+            raise FAT32Error('boot sector signature not found')
+        bytes_per_sector = int.from_bytes(boot[0x0B:0x0D], 'little')
+        sectors_per_cluster = boot[0x0D]
+        reserved = int.from_bytes(boot[0x0E:0x10], 'little')
+        fat_count = boot[0x10]
+        total_sectors = int.from_bytes(boot[0x20:0x24], 'little')
+        fat_size = int.from_bytes(boot[0x24:0x28], 'little')
+        root_cluster = int.from_bytes(boot[0x2C:0x30], 'little')
+        # FAT12/16 have their FAT size at 0x16 instead, FAT32 leaves it 0
+        if bytes_per_sector not in {0x200, 0x400, 0x800, 0x1000} or not sectors_per_cluster or \
+                sectors_per_cluster & (sectors_per_cluster - 1) or not fat_count or not fat_size or \
+                boot[0x16:0x18] != b'\0\0':
+            raise FAT32Error('not a FAT32 file system')
+
+        cluster_size = bytes_per_sector * sectors_per_cluster
+        data_start = (reserved + fat_count * fat_size) * bytes_per_sector
+        fat = array('I')
+        fat.frombytes(read(reserved * bytes_per_sector, fat_size * bytes_per_sector)[:fat_size * bytes_per_sector // 4 * 4])
+        if byteorder != 'little':
+            fat.byteswap()
+        clusters = min(len(fat), (total_sectors * bytes_per_sector - data_start) // cluster_size + 2)
+        walker = _Walker(read, fat, clusters, data_start, cluster_size)
+
+        root = FATNode('', True)
+        # (directory node, its first cluster), and clusters already seen so a broken tree can't loop
+        todo = [(root, root_cluster)]
+        seen = set()
+        while todo:
+            node, cluster = todo.pop()
+            if cluster in seen:
+                continue
+            seen.add(cluster)
+            for child, first in walker.read_dir(cluster):
+                node.children[child.name.lower()] = child
+                if child.is_dir:
+                    todo.append((child, first))
+        return cls(root, cluster_size, data_start, walker.dir_extents)
+
+    def to_dict(self, key: dict) -> dict:
+        return {'version': index_version, 'key': key, 'cluster_size': self.cluster_size,
+                'data_start': self.data_start, 'dir_extents': [x for e in self.dir_extents for x in e],
+                'root': self.root.to_list()}
+
+    @classmethod
+    def load(cls, path: str, key: dict) -> 'Optional[FAT32Index]':
+        """A cached index, if there is one saved with the same key."""
+        try:
+            with open(path, 'r', encoding='utf-8') as f:
+                data = json.load(f)
+            if data.get('version') != index_version or data.get('key') != key:
+                return None
+            dir_extents = data['dir_extents']
+            return cls(FATNode.from_list(data['root']), data['cluster_size'], data['data_start'],
+                       list(zip(dir_extents[0::2], dir_extents[1::2])))
+        except (OSError, ValueError, KeyError, TypeError):
+            return None
+
+    def save(self, path: str, key: dict):
+        # written next to it and renamed, so a reader never sees half of one
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+        tmp = f'{path}.{os.getpid()}.tmp'
+        with open(tmp, 'w', encoding='utf-8') as f:
+            json.dump(self.to_dict(key), f, separators=(',', ':'))
+        os.replace(tmp, path)
+
+
+class _Walker:
+    def __init__(self, read: 'Callable[[int, int], bytes]', fat: array, clusters: int, data_start: int,
+                 cluster_size: int):
+        self.read = read
+        self.fat = fat
+        self.clusters = clusters
+        self.data_start = data_start
+        self.cluster_size = cluster_size
+        # the extents of every directory read
+        self.dir_extents: List[Tuple[int, int]] = []
+
+    def extents(self, cluster: int, size: int = None) -> 'List[Tuple[int, int]]':
+        """Follow a cluster chain, merging consecutive clusters. Stops after size bytes when given."""
+        fat = self.fat
+        extents = []
+        total = 0
+        limit = self.clusters if size is None else (size + self.cluster_size - 1) // self.cluster_size
+        while 2 <= cluster < self.clusters and total < limit:
+            first = cluster
+            count = 1
+            nxt = fat[cluster] & 0x0FFFFFFF
+            while nxt == cluster + 1 and total + count < limit:
+                cluster = nxt
+                count += 1
+                nxt = fat[cluster] & 0x0FFFFFFF
+            extents.append((self.data_start + (first - 2) * self.cluster_size, count * self.cluster_size))
+            total += count
+            cluster = nxt
+        if size is not None and extents:
+            # the last cluster is only used up to the size
+            over = total * self.cluster_size - size
+            if over > 0:
+                offset, length = extents[-1]
+                extents[-1] = (offset, length - over)
+        return extents
+
+    def read_dir(self, cluster: int) -> 'List[Tuple[FATNode, int]]':
+        extents = self.extents(cluster)
+        self.dir_extents += extents
+        data = b''.join(self.read(o, n) for o, n in extents)
+        entries = []
+        lfn = []
+        for i in range(0, len(data) - 31, 32):
+            e = data[i:i + 32]
+            if e[0] == 0:
+                break
+            if e[0] == 0xE5:
+                lfn = []
+                continue
+            attr = e[11]
+            if attr & 0x3F == 0x0F:
+                if e[0] & 0x40:
+                    lfn = []
+                lfn.append(e)
+                continue
+            if attr & 0x08:
+                # volume label
+                lfn = []
+                continue
+
+            short = e[0:11]
+            name = None
+            if lfn:
+                # the long name parts come last first, and all carry the short name's checksum
+                checksum = _lfn_checksum(short)
+                if all(p[13] == checksum for p in lfn):
+                    raw = b''.join(p[1:11] + p[14:26] + p[28:32] for p in reversed(lfn))
+                    name = raw.decode('utf-16le', 'replace').split('\0', 1)[0]
+                lfn = []
+            if not name:
+                base = short[0:8].rstrip(b' ')
+                if base[:1] == b'\x05':
+                    base = b'\xe5' + base[1:]
+                ext = short[8:11].rstrip(b' ')
+                # the case flags windows uses for all lowercase short names
+                base = base.decode('cp437')
+                ext = ext.decode('cp437')
+                if e[12] & 0x08:
+                    base = base.lower()
+                if e[12] & 0x10:
+                    ext = ext.lower()
+                name = base + ('.' + ext if ext else '')
+            if name in {'.', '..'}:
+                continue
+
+            first = int.from_bytes(e[20:22], 'little') << 16 | int.from_bytes(e[26:28], 'little')
+            mtime = _dos_time(int.from_bytes(e[22:24], 'little'), int.from_bytes(e[24:26], 'little'))
+            if attr & 0x10:
+                entries.append((FATNode(name, True, 0, mtime), first))
+            else:
+                size = int.from_bytes(e[28:32], 'little')
+                entries.append((FATNode(name, False, size, mtime, self.extents(first, size) if size else []), first))
+        return entries
@@ -0,0 +1,56 @@
+from collections import defaultdict
+from typing import TYPE_CHECKING
+from zlib import crc32
+
+if TYPE_CHECKING:
+    from typing import BinaryIO, List
+
+bis_key_ids = defaultdict(lambda: -1, {
+    'PRODINFO': 0,
+    'PRODINFOF': 0,
+    'SAFE': 1,
+    'SYSTEM': 2,
+    'USER': 3
+})
+
+
+class GPTError(ValueError):
+    pass
+
+
+def read_partitions(nand_fp: 'BinaryIO') -> 'List[dict]':
+    """
+    Read the partition table of a NAND image. Each partition is a dict of its 'name', 'index' in the
+    table, 'bis_key' (-1 for the ones that aren't encrypted), and 'start' and 'end' offsets in the image.
+    """
+    nand_fp.seek(0x200)
+    gpt_header = nand_fp.read(0x5C)
+    if gpt_header[0:8] != b'EFI PART':
+        raise GPTError('GPT header magic not found.')
+
+    header_to_hash = gpt_header[0:0x10] + b'\0\0\0\0' + gpt_header[0x14:]
+    crc_expected = int.from_bytes(gpt_header[0x10:0x14], 'little')
+    crc_got = crc32(header_to_hash) & 0xFFFFFFFF
+    if crc_got != crc_expected:
+        raise GPTError(f'GPT header crc32 mismatch (expected {crc_expected:08x}, got {crc_got:08x})')
+
+    gpt_part_start = int.from_bytes(gpt_header[0x48:0x50], 'little')
+    gpt_part_count = int.from_bytes(gpt_header[0x50:0x54], 'little')
+    gpt_part_entry_size = int.from_bytes(gpt_header[0x54:0x58], 'little')
+
+    nand_fp.seek(gpt_part_start * 0x200)
+    gpt_part_full_raw = nand_fp.read(gpt_part_count * gpt_part_entry_size)
+    gpt_part_crc_expected = int.from_bytes(gpt_header[0x58:0x5C], 'little')
+    gpt_part_crc_got = crc32(gpt_part_full_raw) & 0xFFFFFFFF
+    if gpt_part_crc_got != gpt_part_crc_expected:
+        raise GPTError(f'GPT Partition table crc32 mismatch '
+                       f'(expected {gpt_part_crc_expected:08x}, got {gpt_part_crc_got:08x})')
+    gpt_parts_raw = [gpt_part_full_raw[i:i + gpt_part_entry_size] for i in range(0, len(gpt_part_full_raw),
+                                                                                 gpt_part_entry_size)]
+    parts = []
+    for idx, part in enumerate(gpt_parts_raw):
+        name = part[0x38:].decode('utf-16le').rstrip('\0')
+        parts.append({'name': name, 'bis_key': bis_key_ids[name], 'index': idx,
+                      'start': int.from_bytes(part[0x20:0x28], 'little') * 0x200,
+                      'end': (int.from_bytes(part[0x28:0x30], 'little') + 1) * 0x200})
+    return parts
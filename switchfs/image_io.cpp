@@ -0,0 +1,434 @@
+/*
+ * Reading an image and decrypting it in place, see xtsn_reader_new in xtsn_core.h.
+ *
+ * io_uring is driven with the raw system calls, so there's no liburing to build against. A read is
+ * split into pieces that are all put in flight at once, and each piece is decrypted as soon as it
+ * completes while the others are still being read. A call takes one of the reader's rings for
+ * itself, so calls from several threads never see each other's completions.
+ */
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "xtsn_core.h"
+
+#if defined _WIN16 || defined _WIN32 || defined _WIN64
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#if defined __linux__ && defined __has_include
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+//IO_URING_OP_SUPPORTED came with the probe and IORING_OP_READ, in 5.6
+#if defined __NR_io_uring_setup && defined __NR_io_uring_enter && defined __NR_io_uring_register && \
+    defined IO_URING_OP_SUPPORTED
+#define URING_BUILD 1
+#endif
+#endif
+#endif
+
+typedef uint8_t u8;
+typedef uint64_t u64;
+
+//each read in flight, big enough that the per read cost doesn't matter, small enough that a read of
+//a few hundred KiB still has several going at once
+static const size_t piece_size = 0x20000;
+static const int default_depth = 32;
+
+//the sector and skipped bytes of the data pos bytes after the start of a read
+static void piece_sector(u64 lo, u64 hi, u64 sector_size, u64 skipped, size_t pos, u64 *piece_lo, u64 *piece_hi,
+                         u64 *piece_skipped) {
+    u64 total = skipped + pos;
+    *piece_lo = lo + total / sector_size;
+    *piece_hi = hi + (*piece_lo < lo);
+    *piece_skipped = total % sector_size;
+}
+
+//one blocking read, looping over short ones until len or the end of the file. -errno on errors
+static long long pread_full(int fd, u8 *buf, size_t len, u64 offset) {
+    size_t got = 0;
+    while(got < len) {
+        #if defined _WIN16 || defined _WIN32 || defined _WIN64
+        OVERLAPPED ov;
+        DWORD read = 0;
+        DWORD want = (DWORD)std::min(len - got, (size_t)0x40000000);
+        memset(&ov, 0, sizeof(ov));
+        ov.Offset = (DWORD)(offset + got);
+        ov.OffsetHigh = (DWORD)((offset + got) >> 32);
+        if(!ReadFile((HANDLE)_get_osfhandle(fd), buf + got, want, &read, &ov)) {
+            if(GetLastError() == ERROR_HANDLE_EOF) break;
+            return -EIO;
+        }
+        #else
+        ssize_t read = pread(fd, buf + got, len - got, (off_t)(offset + got));
+        if(read < 0) {
+            if(errno == EINTR) continue;
+            return -errno;
+        }
+        #endif
+        if(!read) break;
+        got += (size_t)read;
+    }
+    return (long long)got;
+}
+
+#ifdef URING_BUILD
+class Ring {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_sqe *sqes;
+    io_uring_cqe *cqes;
+    void *sq_map, *cq_map, *sqes_map;
+    size_t sq_len, cq_len, sqes_len;
+
+    static void *Map(int fd, size_t len, off_t what) {
+        return mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, what);
+    }
+    bool SupportsRead() {
+        std::vector<u8> mem(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+        io_uring_probe *probe = (io_uring_probe*)mem.data();
+        if(syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0) return false;
+        return probe->last_op >= IORING_OP_READ && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+    }
+    void Add(u8 opcode, int file, u64 addr, unsigned len, u64 offset, u64 data) {
+        unsigned tail = *sq_tail;
+        unsigned idx = tail & *sq_mask;
+        io_uring_sqe *sqe = &sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = file;
+        sqe->addr = addr;
+        sqe->len = len;
+        sqe->off = offset;
+        sqe->user_data = data;
+        sq_array[idx] = idx;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        queued++;
+    }
+public:
+    unsigned entries;
+    //queued and not submitted yet
+    unsigned queued;
+
+    Ring() : fd(-1), sq_map(MAP_FAILED), cq_map(MAP_FAILED), sqes_map(MAP_FAILED), entries(0), queued(0) {}
+    ~Ring() {
+        if(sqes_map != MAP_FAILED) munmap(sqes_map, sqes_len);
+        if(cq_map != MAP_FAILED && cq_map != sq_map) munmap(cq_map, cq_len);
+        if(sq_map != MAP_FAILED) munmap(sq_map, sq_len);
+        if(fd >= 0) close(fd);
+    }
+    //false where the kernel has no io_uring, turned it off, or can't read with it yet
+    bool Open(unsigned depth) {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        if((fd = (int)syscall(__NR_io_uring_setup, depth, &p)) < 0) return false;
+        sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if(single) sq_len = cq_len = std::max(sq_len, cq_len);
+        if((sq_map = Map(fd, sq_len, IORING_OFF_SQ_RING)) == MAP_FAILED) return false;
+        cq_map = single ? sq_map : Map(fd, cq_len, IORING_OFF_CQ_RING);
+        if(cq_map == MAP_FAILED) return false;
+        sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+        if((sqes_map = Map(fd, sqes_len, IORING_OFF_SQES)) == MAP_FAILED) return false;
+
+        u8 *sq = (u8*)sq_map, *cq = (u8*)cq_map;
+        sq_tail = (unsigned*)(sq + p.sq_off.tail);
+        sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+        sq_array = (unsigned*)(sq + p.sq_off.array);
+        cq_head = (unsigned*)(cq + p.cq_off.head);
+        cq_tail = (unsigned*)(cq + p.cq_off.tail);
+        cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+        sqes = (io_uring_sqe*)sqes_map;
+        entries = p.sq_entries;
+        return SupportsRead();
+    }
+    //queues a read, which the caller made sure there's room for
+    void Queue(int file, void *buf, unsigned len, u64 offset, u64 data) {
+        Add(IORING_OP_READ, file, (u64)(uintptr_t)buf, len, offset, data);
+    }
+    //queues cancelling the request with user data target, if there's room
+    bool Cancel(u64 target, u64 data) {
+        if(queued >= entries) return false;
+        Add(IORING_OP_ASYNC_CANCEL, -1, target, 0, 0, data);
+        return true;
+    }
+    //submits what's queued unless told not to, and waits for a completion with wait. -errno on errors
+    int Enter(bool wait, bool submit = true) {
+        unsigned count = submit ? queued : 0;
+        if(!wait && !count) return 0;
+        while(true) {
+            int ret = (int)syscall(__NR_io_uring_enter, fd, count, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0,
+                                   NULL, 0);
+            if(ret >= 0) {
+                queued -= std::min((unsigned)ret, queued);
+                return 0;
+            }
+            if(errno != EINTR && errno != EAGAIN && errno != EBUSY) return -errno;
+        }
+    }
+    bool Reap(io_uring_cqe *out) {
+        unsigned head = *cq_head;
+        if(head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) return false;
+        *out = cqes[head & *cq_mask];
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+};
+#else
+class Ring {
+public:
+    unsigned entries;
+    bool Open(unsigned depth) {return false;}
+};
+#endif
+
+struct xtsn_reader {
+    int fd;
+    int engine;
+    unsigned depth;
+    std::mutex lock;
+    std::vector<Ring*> idle;
+
+    //a ring for one call, NULL if another can't be made right now
+    Ring *Take() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if(!idle.empty()) {
+                Ring *ring = idle.back();
+                idle.pop_back();
+                return ring;
+            }
+        }
+        Ring *ring = new (std::nothrow) Ring();
+        if(ring && !ring->Open(depth)) {
+            delete ring;
+            return NULL;
+        }
+        return ring;
+    }
+    void Give(Ring *ring) {
+        std::lock_guard<std::mutex> guard(lock);
+        idle.push_back(ring);
+    }
+    ~xtsn_reader() {
+        for(Ring *ring : idle) delete ring;
+    }
+};
+
+static int decrypt_piece(xtsn_ctx *ctx, u8 *buf, size_t pos, size_t len, u64 lo, u64 hi, u64 sector_size,
+                         u64 skipped) {
+    u64 piece_lo, piece_hi, piece_skipped;
+    len &= ~(size_t)0xF;
+    if(!len) return XTSN_OK;
+    piece_sector(lo, hi, sector_size, skipped, pos, &piece_lo, &piece_hi, &piece_skipped);
+    return xtsn_decrypt(ctx, buf + pos, NULL, len, piece_lo, piece_hi, sector_size, piece_skipped, 1);
+}
+
+#ifdef URING_BUILD
+struct Piece {
+    size_t pos;
+    size_t len;
+    size_t done;
+    bool busy; //a read of it is in flight
+};
+
+//what's left to do with a ring after a call
+enum {
+    RING_KEEP,      //idle, back to the pool
+    RING_DROP,      //submitting or waiting failed, but nothing is in flight anymore
+    RING_STUCK,     //reads may still be in flight, so it can't even be closed
+};
+
+static const u64 cancel_data = ~0ULL;
+
+//after submitting or waiting failed: cancels the reads still in flight and waits until all of them are done,
+//so the kernel won't write to the buffer after the call returns. false if even that doesn't work
+static bool drain(Ring *ring, std::vector<Piece> &pieces, unsigned inflight) {
+    //reads the kernel never took aren't in flight, and won't be once the ring is closed
+    bool submit = !ring->Enter(false);
+    if(submit) {
+        for(size_t i = 0; i < pieces.size(); i++) {
+            if(pieces[i].busy && !ring->Cancel(i, cancel_data)) break;
+        }
+    } else {
+        inflight -= std::min(inflight, ring->queued);
+    }
+    while(inflight) {
+        if(ring->Enter(true, submit)) {
+            //all reads were submitted before the cancels, so this only leaves the cancels behind
+            if(!submit) return false;
+            submit = false;
+            continue;
+        }
+        io_uring_cqe cqe;
+        while(ring->Reap(&cqe)) {
+            if(cqe.user_data != cancel_data) inflight--;
+        }
+    }
+    return true;
+}
+
+//returns bytes read or -errno. every read is finished before it returns, unless the ring is left stuck
+static long long uring_read_decrypt(xtsn_reader *reader, Ring *ring, xtsn_ctx *ctx, u8 *buf, size_t len,
+                                    u64 offset, u64 lo, u64 hi, u64 sector_size, u64 skipped, int *decrypt_err,
+                                    int *state) {
+    std::vector<Piece> pieces;
+    for(size_t pos = 0; pos < len; pos += piece_size)
+        pieces.push_back(Piece{pos, std::min(piece_size, len - pos), 0, false});
+    std::vector<size_t> ready;
+    unsigned depth = std::min(reader->depth, ring->entries), inflight = 0;
+    size_t next = 0, end = len;
+    int error = 0;
+
+    while(true) {
+        //a read that came back short or empty means the file ends there, nothing after it is queued
+        while(!error && inflight < depth && next < pieces.size() && pieces[next].pos < end) {
+            Piece &p = pieces[next];
+            ring->Queue(reader->fd, buf + p.pos, (unsigned)p.len, offset + p.pos, next);
+            p.busy = true;
+            next++;
+            inflight++;
+        }
+        if(!inflight) break;
+        int err = ring->Enter(true);
+        if(err) {
+            *state = drain(ring, pieces, inflight) ? RING_DROP : RING_STUCK;
+            return err;
+        }
+
+        io_uring_cqe cqe;
+        while(ring->Reap(&cqe)) {
+            inflight--;
+            Piece &p = pieces[cqe.user_data];
+            p.busy = false;
+            if(cqe.res < 0) {
+                if(!error) error = -cqe.res;
+                continue;
+            }
+            p.done += (size_t)cqe.res;
+            if(!cqe.res) {
+                end = std::min(end, p.pos + p.done);
+            } else if(p.done < p.len) {
+                //short, but not necessarily the end, so the rest is read again
+                ring->Queue(reader->fd, buf + p.pos + p.done, (unsigned)(p.len - p.done), offset + p.pos + p.done,
+                            cqe.user_data);
+                p.busy = true;
+                inflight++;
+            } else {
+                ready.push_back(cqe.user_data);
+            }
+        }
+        //the next reads go out before this thread gets busy decrypting
+        while(!error && inflight < depth && next < pieces.size() && pieces[next].pos < end) {
+            Piece &p = pieces[next];
+            ring->Queue(reader->fd, buf + p.pos, (unsigned)p.len, offset + p.pos, next);
+            p.busy = true;
+            next++;
+            inflight++;
+        }
+        if((err = ring->Enter(false))) {
+            *state = drain(ring, pieces, inflight) ? RING_DROP : RING_STUCK;
+            return err;
+        }
+        if(ctx && !error && !*decrypt_err) {
+            for(size_t i : ready) {
+                Piece &p = pieces[i];
+                if(p.pos + p.len <= end)
+                    *decrypt_err = decrypt_piece(ctx, buf, p.pos, p.len, lo, hi, sector_size, skipped);
+            }
+        }
+        ready.clear();
+    }
+    if(error) return -error;
+    //the piece the file ends in wasn't complete, so it's still to be decrypted
+    if(ctx && end < len && !*decrypt_err) {
+        size_t pos = end / piece_size * piece_size;
+        *decrypt_err = decrypt_piece(ctx, buf, pos, end - pos, lo, hi, sector_size, skipped);
+    }
+    return (long long)end;
+}
+#endif
+
+extern "C" {
+
+int xtsn_reader_new(int fd, int engine, int depth, xtsn_reader **reader) {
+    if(depth < 0) return XTSN_ERR_INVALID_ARG;
+    if(engine != XTSN_IO_AUTO && engine != XTSN_IO_PREAD && engine != XTSN_IO_URING) return XTSN_ERR_INVALID_ARG;
+    xtsn_reader *r = new (std::nothrow) xtsn_reader();
+    if(!r) return XTSN_ERR_NOMEM;
+    r->fd = fd;
+    r->depth = depth ? (unsigned)depth : default_depth;
+    r->engine = XTSN_IO_PREAD;
+    if(engine != XTSN_IO_PREAD) {
+        //the first ring tells if io_uring works, and is kept for the first call
+        Ring *ring = r->Take();
+        if(ring) {
+            r->engine = XTSN_IO_URING;
+            r->Give(ring);
+        } else if(engine == XTSN_IO_URING) {
+            delete r;
+            return XTSN_ERR_UNAVAILABLE;
+        }
+    }
+    *reader = r;
+    return XTSN_OK;
+}
+
+const char *xtsn_reader_engine(xtsn_reader *reader) {
+    return reader->engine == XTSN_IO_URING ? "io_uring" : "pread";
+}
+
+int xtsn_read_decrypt(xtsn_reader *reader, xtsn_ctx *ctx, void *buf, size_t len, uint64_t offset,
+                      uint64_t sector_lo, uint64_t sector_hi, uint64_t sector_size, uint64_t skipped_bytes,
+                      size_t *got) {
+    if(ctx) {
+        if(!sector_size) return XTSN_ERR_SECTOR_SIZE_ZERO;
+        if(sector_size % 16) return XTSN_ERR_SECTOR_SIZE;
+        if(skipped_bytes % 16) return XTSN_ERR_SKIPPED;
+    }
+    u8 *data = (u8*)buf;
+    long long ret;
+    int err = XTSN_OK;
+    #ifdef URING_BUILD
+    Ring *ring = reader->engine == XTSN_IO_URING ? reader->Take() : NULL;
+    if(ring) {
+        int state = RING_KEEP;
+        ret = uring_read_decrypt(reader, ring, ctx, data, len, offset, sector_lo, sector_hi, sector_size,
+                                 skipped_bytes, &err, &state);
+        //a ring that failed isn't trusted again. a stuck one is left open, closing it wouldn't stop
+        //what's still in flight from landing in the buffer either
+        if(state == RING_KEEP) reader->Give(ring);
+        else if(state == RING_DROP) delete ring;
+    } else
+    #endif
+    {
+        //with no ring to spare it reads the simple way
+        ret = pread_full(reader->fd, data, len, offset);
+        if(ret > 0 && ctx) err = decrypt_piece(ctx, data, 0, (size_t)ret, sector_lo, sector_hi, sector_size,
+                                               skipped_bytes);
+    }
+    if(ret < 0) {
+        errno = (int)-ret;
+        return XTSN_ERR_IO;
+    }
+    if(err) return err;
+    *got = ctx ? (size_t)ret & ~(size_t)0xF : (size_t)ret;
+    return XTSN_OK;
+}
+
+void xtsn_reader_free(xtsn_reader *reader) {
+    delete reader;
+}
+
+} //extern
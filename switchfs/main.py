@@ -10,6 +10,8 @@ python_cmd = 'py -3' if windows else 'python3'
 
 mount_types = ('nand',)
 mount_aliases = {}
+# not mounts, these don't need fuse
+tool_types = ('nanddump',)
 
 _path = dirname(realpath(__file__))
 if _path not in path:
@@ -27,10 +29,18 @@ if hexversion < 0x030601F0:
 def exit_print_types():
     print('Please provide a mount type as the first argument.')
     print(' ', ', '.join(mount_types))
+    print('Or a tool:')
+    print(' ', ', '.join(tool_types))
     exit(1)
 
 
 def mount(mount_type: str, return_doc: bool = False) -> int:
+    if mount_type in tool_types:
+        module = import_module(mount_type)
+        if return_doc:
+            return module.__doc__
+        return module.main(prog=None if __name__ == '__main__' else mount_type)
+
     if windows:
         from ctypes import windll
         if windll.shell32.IsUserAnAdmin():
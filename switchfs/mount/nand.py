@@ -1,32 +1,210 @@
+import json
 import logging
+import mmap
 import os
 from collections import defaultdict
-from errno import ENOENT, EROFS
+from functools import wraps
+from hashlib import sha1
+from itertools import count
+from errno import EIO, ENOENT, EROFS
+from queue import Queue
 from stat import S_IFDIR, S_IFREG
 from sys import argv, exit
+from threading import Condition, Event, Lock, RLock, Thread, local
+from time import monotonic, perf_counter_ns
 from typing import TYPE_CHECKING
-from zlib import crc32
 
-from crypto import XTSN, parse_biskeydump
+from crypto import XTSN, ImageReader, SectorCache, parse_biskeydump, stats as xtsn_stats
+from fat32 import FAT32Error, FAT32Index
+from gpt import GPTError, read_partitions
 from ._common import FUSE, FuseOSError, Operations, LoggingMixIn, fuse_get_context
 from . import _common as _c
 
 if TYPE_CHECKING:
-    from typing import BinaryIO, List
-
-bis_key_ids = defaultdict(lambda: -1, {
-    'PRODINFO': 0,
-    'PRODINFOF': 0,
-    'SAFE': 1,
-    'SYSTEM': 2,
-    'USER': 3
-})
+    from typing import BinaryIO, Dict, List, Optional, Tuple
+    from fat32 import FATNode
+
+# the XTS sector size of the encrypted partitions, also the unit that gets cached
+nand_sector_size = 0x4000
+# a partition directory's tree is built again at most this often in seconds after writes change it, the old
+# one is used until then
+fat_rebuild_interval = 2.0
+
+log = logging.getLogger('switchfs.nand')
+stats_log = logging.getLogger('switchfs.nand.stats')
+
+
+def default_fat_cache_dir() -> str:
+    if _c.windows:
+        base = os.environ.get('LOCALAPPDATA') or os.path.expanduser('~')
+    elif _c.macos:
+        base = os.path.expanduser('~/Library/Caches')
+    else:
+        base = os.environ.get('XDG_CACHE_HOME') or os.path.expanduser('~/.cache')
+    return os.path.join(base, 'switchfs')
+
+
+class MountStats:
+    """
+    Calls and bytes per partition and operation, and how long the calls took as histograms with
+    power of two microsecond buckets. Cheap enough to always be kept.
+    """
+
+    buckets = 32
+
+    def __init__(self):
+        self.lock = Lock()
+        # partition file name: {'reads', 'read_bytes', 'writes', 'write_bytes'}
+        self.parts: Dict[str, Dict[str, int]] = defaultdict(
+            lambda: {'reads': 0, 'read_bytes': 0, 'writes': 0, 'write_bytes': 0})
+        # op: counts, bucket n has the calls that took less than 2**n microseconds
+        self.latency = {'read': [0] * self.buckets, 'write': [0] * self.buckets}
+
+    def record(self, op: str, part: str, size: int, ns: int):
+        bucket = min((ns // 1000).bit_length(), self.buckets - 1)
+        with self.lock:
+            counts = self.parts[part]
+            counts[op + 's'] += 1
+            counts[op + '_bytes'] += size
+            self.latency[op][bucket] += 1
+
+    def snapshot(self) -> dict:
+        with self.lock:
+            return {'partitions': {k: dict(v) for k, v in self.parts.items()},
+                    'latency_us': {op: {f'<{1 << i}': n for i, n in enumerate(h) if n}
+                                   for op, h in self.latency.items()}}
+
+
+def _counted(op: str):
+    # records read or write calls in the mount's stats, the path has to be lowercase already.
+    # reads of files in a partition directory count for the partition
+    def decorator(method):
+        @wraps(method)
+        def wrapper(self, path, *args, **kwargs):
+            start = perf_counter_ns()
+            ret = method(self, path, *args, **kwargs)
+            fi = self.files.get(path) or self._fat_part(path)
+            if fi is not None:
+                self.counters.record(op, fi['real_filename'], len(ret) if op == 'read' else ret,
+                                     perf_counter_ns() - start)
+            return ret
+        return wrapper
+    return decorator
+
+
+class ReadAhead:
+    """
+    Decrypts the sectors after a sequential reader into the sector cache on a background thread,
+    so the next read is served from memory while this one is still being handled.
+    """
+
+    def __init__(self, mount: 'NANDImageMount', window: int, trigger: int):
+        self.mount = mount
+        # sectors kept decrypted ahead of a reader
+        self.window = window
+        # sequential reads on a handle before it gets read-ahead
+        self.trigger = trigger
+        # fh: [next offset, sequential reads, first sector not yet queued], FUSE threads share it
+        self.handles: Dict[int, list] = {}
+        self.handles_lock = Lock()
+        self.queue = Queue()
+        # (partition index, first sector, end sector) queued or being read right now
+        self.pending = []
+        self.stopped = False
+        self.done = Condition(mount.io_lock)
+        self._buf = bytearray()
+        self.thread = Thread(target=self._run, name='nand-readahead', daemon=True)
+        self.thread.start()
+
+    def access(self, fh: int, fi: dict, offset: int, size: int):
+        # nothing would take what's queued off pending again
+        if not self.thread.is_alive():
+            return
+        part_sectors = (fi['end'] - fi['start'] + nand_sector_size - 1) // nand_sector_size
+        with self.handles_lock:
+            state = self.handles.get(fh)
+            if state is None or state[0] != offset:
+                state = self.handles[fh] = [offset, 0, 0]
+            state[0] = offset + size
+            state[1] += 1
+            if state[1] < self.trigger:
+                return
+            first = max(state[2], (offset + size + nand_sector_size - 1) // nand_sector_size)
+            end = min((offset + size) // nand_sector_size + self.window, part_sectors)
+            # topped up in half windows, so each queued read is big enough to be worth it
+            if not (end - first >= max(self.window // 2, 1) or (end == part_sectors and end > first)):
+                return
+            state[2] = end
+
+        item = (fi['index'], first, end)
+        self.mount.advise(fi['start'] + first * nand_sector_size, (end - first) * nand_sector_size,
+                          'MADV_SEQUENTIAL', 'MADV_WILLNEED')
+        with self.done:
+            self.pending.append(item)
+        self.queue.put((item, fi))
+
+    def forget(self, fh: int):
+        with self.handles_lock:
+            self.handles.pop(fh, None)
+
+    def wait(self, index: int, first: int, end: int):
+        # a read for sectors that are already being read ahead waits for them instead of reading them twice
+        with self.done:
+            while self.thread.is_alive() and \
+                    any(p[0] == index and p[1] < end and first < p[2] for p in self.pending):
+                self.done.wait(1)
+
+    def stop(self):
+        # anything still queued is dropped, the file is about to be closed
+        self.stopped = True
+        self.queue.put(None)
+        self.thread.join()
+        with self.done:
+            self.pending.clear()
+            self.done.notify_all()
+
+    def _run(self):
+        mount = self.mount
+        while True:
+            item = self.queue.get()
+            if self.stopped:
+                return
+            item, fi = item
+            first = item[1]
+            count = item[2] - first
+            size = min(count * nand_sector_size, fi['end'] - fi['start'] - first * nand_sector_size)
+            if len(self._buf) < size:
+                self._buf = bytearray(size)
+            buf = memoryview(self._buf)[:size]
+            decrypted = False
+            try:
+                with self.done:
+                    writes = mount.writes
+                # the GIL is released while this decrypts
+                buf = mount.read_decrypt(fi['start'] + first * nand_sector_size, buf,
+                                         mount.crypto[fi['bis_key']], first)
+                decrypted = True
+            except Exception as e:
+                # only a missed prefetch, the reader that wanted these reads them itself and gets the error
+                log.warning('read-ahead of %s sectors %d-%d failed: %s', fi['real_filename'], first, item[2], e)
+            finally:
+                with self.done:
+                    # a write since the read makes these stale, they are dropped instead
+                    if decrypted and writes == mount.writes:
+                        for i in range(0, len(buf), nand_sector_size):
+                            mount.cache.put(fi['index'], first + i // nand_sector_size,
+                                            bytes(buf[i:i + nand_sector_size]))
+                    self.pending.remove(item)
+                    self.done.notify_all()
 
 
 class NANDImageMount(LoggingMixIn, Operations):
-    fd = 0
 
-    def __init__(self, nand_fp: 'BinaryIO', g_stat: os.stat_result, keys: str, readonly: bool = False):
+    def __init__(self, nand_fp: 'BinaryIO', g_stat: os.stat_result, keys: str, readonly: bool = False,
+                 cache_size: int = 32 * 1024 * 1024, readahead_size: int = 1024 * 1024,
+                 readahead_trigger: int = 2, use_mmap: bool = True, writeback_size: int = 4 * 1024 * 1024,
+                 stats_interval: float = 0, fat: bool = True, fat_cache_dir: 'Optional[str]' = None,
+                 io_engine: str = 'auto'):
         self.readonly = readonly
         self.g_stat = {'st_ctime': int(g_stat.st_ctime), 'st_mtime': int(g_stat.st_mtime),
                        'st_atime': int(g_stat.st_atime)}
@@ -37,39 +215,341 @@ class NANDImageMount(LoggingMixIn, Operations):
             self.crypto[x] = XTSN(*bis_keys[x])
 
         self.files = {}
-        nand_fp.seek(0x200)
-        gpt_header = nand_fp.read(0x5C)
-        if gpt_header[0:8] != b'EFI PART':
-            exit('GPT header magic not found.')
-
-        header_to_hash = gpt_header[0:0x10] + b'\0\0\0\0' + gpt_header[0x14:]
-        crc_expected = int.from_bytes(gpt_header[0x10:0x14], 'little')
-        crc_got = crc32(header_to_hash) & 0xFFFFFFFF
-        if crc_got != crc_expected:
-            exit(f'GPT header crc32 mismatch (expected {crc_expected:08x}, got {crc_got:08x})')
-
-        gpt_part_start = int.from_bytes(gpt_header[0x48:0x50], 'little')
-        gpt_part_count = int.from_bytes(gpt_header[0x50:0x54], 'little')
-        gpt_part_entry_size = int.from_bytes(gpt_header[0x54:0x58], 'little')
-
-        nand_fp.seek(gpt_part_start * 0x200)
-        gpt_part_full_raw = nand_fp.read(gpt_part_count * gpt_part_entry_size)
-        gpt_part_crc_expected = int.from_bytes(gpt_header[0x58:0x5C], 'little')
-        gpt_part_crc_got = crc32(gpt_part_full_raw) & 0xFFFFFFFF
-        if gpt_part_crc_got != gpt_part_crc_expected:
-            exit(f'GPT Partition table crc32 mismatch '
-                 f'(expected {gpt_part_crc_expected:08x}, got {gpt_part_crc_got:08x})')
-        gpt_parts_raw = [gpt_part_full_raw[i:i + gpt_part_entry_size] for i in range(0, len(gpt_part_full_raw),
-                                                                                     gpt_part_entry_size)]
-        for part in gpt_parts_raw:
-            name = part[0x38:].decode('utf-16le').rstrip('\0')
-            self.files[f'/{name.lower()}.img'] = {'real_filename': name + '.img', 'bis_key': bis_key_ids[name],
-                                                  'start': int.from_bytes(part[0x20:0x28], 'little') * 0x200,
-                                                  'end': (int.from_bytes(part[0x28:0x30], 'little') + 1) * 0x200}
+        # the same partitions by their index
+        self.parts = {}
+        try:
+            partitions = read_partitions(nand_fp)
+        except GPTError as e:
+            exit(str(e))
+        for part in partitions:
+            name = part['name']
+            self.files[f'/{name.lower()}.img'] = {'real_filename': name + '.img', 'bis_key': part['bis_key'],
+                                                  'index': part['index'], 'start': part['start'],
+                                                  'end': part['end']}
+            self.parts[part['index']] = self.files[f'/{name.lower()}.img']
 
         self.f = nand_fp
+        self._fds = count(1)
+        # with a mapping of the image, reads are decrypted straight out of it instead of going through self.f
+        self.map: Optional[mmap.mmap] = None
+        if use_mmap:
+            try:
+                self.map = mmap.mmap(nand_fp.fileno(), 0, access=mmap.ACCESS_READ if readonly else mmap.ACCESS_WRITE)
+            except (OSError, ValueError, OverflowError):
+                # not a regular file, or too big for the address space
+                pass
+        # otherwise, encrypted sectors are read with io_uring where the kernel has it, decrypting each piece as
+        # it lands. without pread the file position is shared, so those reads stay on self.f under io_lock
+        self.reader: Optional[ImageReader] = None
+        if self.map is None and hasattr(os, 'pread'):
+            try:
+                self.reader = ImageReader(nand_fp.fileno(), io_engine)
+            except OSError as e:
+                exit(str(e))
+        # read buffers are per thread, FUSE may call in from several at once
+        self._local = local()
+        # decrypted sectors, keyed by partition index and sector number
+        self.cache = SectorCache(cache_size) if cache_size else None
+        # guards the file position where there's no pread/pwrite, and orders writes against cache fills
+        self.io_lock = RLock()
+        # a write reads the partial blocks around it before writing them back, so only one can run at a time
+        self.write_lock = Lock()
+        # written sectors that aren't encrypted and written to the image yet, as
+        # (partition index, sector): [decrypted sector, first dirty byte, end of dirty bytes]
+        self.dirty: Dict[tuple, list] = {}
+        self.writeback_size = writeback_size
+        # bumped on every write, so read-ahead can tell if what it read is still current
+        self.writes = 0
+        # prefetched sectors go into the cache, so it needs one
+        self.readahead: Optional[ReadAhead] = None
+        if self.cache is not None and readahead_size >= nand_sector_size:
+            self.readahead = ReadAhead(self, readahead_size // nand_sector_size, readahead_trigger)
+        self.counters = MountStats()
+        # logs stats() every stats_interval seconds until the mount goes away
+        self._stats_stop = Event()
+        if stats_interval > 0:
+            Thread(target=self._log_stats, args=(stats_interval,), name='nand-stats', daemon=True).start()
+
+        # the FAT32 partitions also show up as directories of their files, e.g. /USER/Contents,
+        # lowercase name: partition
+        self.fat_dirs: Dict[str, dict] = {}
+        self.fat_lock = Lock()
+        if fat:
+            image = getattr(nand_fp, 'name', None)
+            image = os.path.realpath(image) if isinstance(image, str) and fat_cache_dir else None
+            for fi in self.files.values():
+                # SAFE, SYSTEM and USER, PRODINFOF is FAT12
+                if fi['bis_key'] <= 0:
+                    continue
+                name = fi['real_filename'][:-4]
+                if image:
+                    # reused for as long as the image isn't changed
+                    fi['fat_key'] = {'image': image, 'size': g_stat.st_size, 'mtime_ns': g_stat.st_mtime_ns,
+                                     'partition': name, 'start': fi['start'], 'end': fi['end']}
+                    fi['fat_cache'] = os.path.join(
+                        fat_cache_dir, sha1(f'{image}:{name}'.encode('utf-8')).hexdigest() + '.json')
+                fi['fat_stale'] = False
+                if self._load_fat(fi):
+                    self.fat_dirs[name.lower()] = {'name': name, 'part': fi}
+
+    def _load_fat(self, fi: dict) -> bool:
+        index = None
+        if 'fat_cache' in fi:
+            index = FAT32Index.load(fi['fat_cache'], fi['fat_key'])
+        if index is None:
+            try:
+                index = FAT32Index.build(lambda offset, size: self._read_partition(fi, offset, size, 0))
+            except FAT32Error as e:
+                log.warning('%s: not showing its files: %s', fi['real_filename'], e)
+                return False
+            if 'fat_cache' in fi:
+                try:
+                    index.save(fi['fat_cache'], fi['fat_key'])
+                except OSError as e:
+                    log.warning('%s: could not save the index: %s', fi['real_filename'], e)
+        fi['fat'] = index
+        fi['fat_built'] = monotonic()
+        return True
+
+    def _fat_part(self, path: str) -> 'Optional[dict]':
+        # the partition of a lowercase path in a partition directory, without looking it up
+        fat_dir = self.fat_dirs.get(path.strip('/').split('/', 1)[0])
+        return fat_dir['part'] if fat_dir else None
+
+    def _fat_lookup(self, path: str) -> 'Tuple[Optional[dict], Optional[FATNode]]':
+        # the partition and node for a lowercase path in a partition directory
+        parts = path.strip('/').split('/')
+        fat_dir = self.fat_dirs.get(parts[0])
+        if fat_dir is None:
+            return None, None
+        fi = fat_dir['part']
+        # the partition's FATs or directories were written to, so the tree may have changed. one thread
+        # builds it again while the others go on with the old one
+        if fi['fat_stale'] and monotonic() - fi['fat_built'] >= fat_rebuild_interval and \
+                self.fat_lock.acquire(blocking=False):
+            try:
+                if fi['fat_stale']:
+                    # writes from here on mark it again
+                    fi['fat_stale'] = False
+                    # the saved one isn't kept up to date, the image's new mtime keeps it from being used
+                    # next time
+                    fi.pop('fat_cache', None)
+                    if not self._load_fat(fi):
+                        fi['fat'] = None
+            finally:
+                self.fat_lock.release()
+        if fi['fat'] is None:
+            return fi, None
+        return fi, fi['fat'].lookup(parts[1:])
+
+    def stats(self) -> dict:
+        """Counters of the mount, its sector cache and the XTSN extension."""
+        ret = self.counters.snapshot()
+        if self.cache is not None:
+            cache = self.cache.stats()
+            lookups = cache['hits'] + cache['misses']
+            ret['cache'] = {**cache, 'hit_rate': cache['hits'] / lookups if lookups else 0.0}
+        ret['xtsn'] = xtsn_stats()
+        ret['io'] = 'mmap' if self.map is not None else self.reader.engine if self.reader is not None else 'read'
+        return ret
+
+    def _log_stats(self, interval: float):
+        while not self._stats_stop.wait(interval):
+            stats_log.info('%s', json.dumps(self.stats(), separators=(',', ':')))
+
+    def _get_read_buf(self, size: int) -> memoryview:
+        # reused between reads, so decrypting happens in place without new allocations
+        read_buf = getattr(self._local, 'read_buf', None)
+        if read_buf is None or len(read_buf) < size:
+            read_buf = self._local.read_buf = bytearray(size)
+        return memoryview(read_buf)[:size]
+
+    def _read_at(self, real_offset: int, buf: memoryview) -> int:
+        with self.io_lock:
+            self.f.seek(real_offset)
+            return self.f.readinto(buf)
+
+    def _write_at(self, real_offset: int, data):
+        if hasattr(os, 'pwrite'):
+            data = memoryview(data)
+            while data:
+                written = os.pwrite(self.f.fileno(), data, real_offset)
+                data = data[written:]
+                real_offset += written
+            return
+        with self.io_lock:
+            self.f.seek(real_offset)
+            self.f.write(data)
+
+    def read_decrypt(self, real_offset: int, buf: memoryview, xtsn: XTSN, sector_off: int,
+                     skipped_bytes: int = 0) -> memoryview:
+        """Read the image at real_offset into buf and decrypt it, returning the part of buf that was filled."""
+        if self.map is not None:
+            size = max(min(len(buf), len(self.map) - real_offset), 0) & ~0xF
+            with memoryview(self.map) as m, m[real_offset:real_offset + size] as src:
+                xtsn.decrypt_into(src, sector_off, nand_sector_size, skipped_bytes, out=buf)
+            return buf[:size]
+
+        if self.reader is not None:
+            return buf[:self.reader.read_decrypt(real_offset, buf, xtsn, sector_off, nand_sector_size, skipped_bytes)]
+
+        buf = buf[:self._read_at(real_offset, buf) & ~0xF]
+        xtsn.decrypt_into(buf, sector_off, nand_sector_size, skipped_bytes)
+        return buf
+
+    def advise(self, real_offset: int, size: int, *advice: str):
+        # hints for the mapping, ignored where madvise or the hint is missing
+        if self.map is None or not hasattr(self.map, 'madvise'):
+            return
+        start = real_offset - real_offset % mmap.PAGESIZE
+        size = min(size + real_offset - start, len(self.map) - start)
+        for name in advice:
+            if hasattr(mmap, name) and size > 0:
+                self.map.madvise(getattr(mmap, name), start, size)
+
+    def _read_sectors(self, fi: dict, first: int, count: int) -> 'List[bytes]':
+        # one read and decrypt for the whole run, then each sector is cached on its own
+        part_size = fi['end'] - fi['start']
+        size = min(count * nand_sector_size, part_size - first * nand_sector_size)
+        with self.io_lock:
+            writes = self.writes
+        buf = self.read_decrypt(fi['start'] + first * nand_sector_size, self._get_read_buf(size),
+                                self.crypto[fi['bis_key']], first)
+        sectors = []
+        for i in range(first, first + count):
+            sector = bytes(buf[(i - first) * nand_sector_size:(i - first + 1) * nand_sector_size])
+            if not sector:
+                break
+            sectors.append(sector)
+        with self.io_lock:
+            # a write from another thread since the read makes these stale, so they aren't kept
+            if writes == self.writes:
+                for i, sector in enumerate(sectors, first):
+                    self.cache.put(fi['index'], i, sector)
+        return sectors
+
+    def _read_cached(self, fi: dict, offset: int, size: int) -> bytes:
+        first = offset // nand_sector_size
+        last = (offset + size - 1) // nand_sector_size
+        if self.readahead:
+            self.readahead.wait(fi['index'], first, last + 1)
+        sectors = []
+        missing = 0
+        for i in range(first, last + 1):
+            dirty = self.dirty.get((fi['index'], i))
+            sector = bytes(dirty[0]) if dirty else self.cache.get(fi['index'], i)
+            if sector is None:
+                missing += 1
+                continue
+            if missing:
+                sectors.extend(self._read_sectors(fi, i - missing, missing))
+                missing = 0
+            sectors.append(sector)
+        if missing:
+            sectors.extend(self._read_sectors(fi, last + 1 - missing, missing))
+
+        start = offset - first * nand_sector_size
+        if len(sectors) == 1:
+            return sectors[0][start:start + size]
+        views = [memoryview(x) for x in sectors]
+        views[0] = views[0][start:]
+        end = start + size - (len(views) - 1) * nand_sector_size
+        views[-1] = views[-1][:end]
+        return b''.join(views)
+
+    def _overlay_dirty(self, fi: dict, offset: int, buf: memoryview):
+        # buf has the decrypted image from offset in the partition, the written sectors still have to go over it
+        if not self.dirty:
+            return
+        for i in range(offset // nand_sector_size, (offset + len(buf) - 1) // nand_sector_size + 1):
+            dirty = self.dirty.get((fi['index'], i))
+            if dirty:
+                sector_start = i * nand_sector_size
+                start = max(offset, sector_start)
+                end = min(offset + len(buf), sector_start + len(dirty[0]))
+                buf[start - offset:end - offset] = dirty[0][start - sector_start:end - sector_start]
+
+    def _write_raw(self, real_offset: int, data):
+        if self.map is not None:
+            self.map[real_offset:real_offset + len(data)] = data
+        else:
+            self._write_at(real_offset, data)
+
+    def _write_back(self, fi: dict, offset: int, data: bytes):
+        # gathers the write in the dirty sectors, which get encrypted once when they're flushed
+        part_size = fi['end'] - fi['start']
+        data = memoryview(data)
+        pos = 0
+        while pos < len(data):
+            sector, start = divmod(offset + pos, nand_sector_size)
+            sector_len = min(nand_sector_size, part_size - sector * nand_sector_size)
+            size = min(sector_len - start, len(data) - pos)
+            key = (fi['index'], sector)
+            dirty = self.dirty.get(key)
+            if dirty is None:
+                if size == sector_len:
+                    buf = bytearray(sector_len)
+                elif self.cache is not None:
+                    buf = bytearray(self._read_cached(fi, sector * nand_sector_size, sector_len))
+                else:
+                    buf = bytearray(sector_len)
+                    # decrypted in place, a short read means the image ends before the partition does
+                    if len(self.read_decrypt(fi['start'] + sector * nand_sector_size, memoryview(buf),
+                                             self.crypto[fi['bis_key']], sector)) < sector_len:
+                        raise FuseOSError(EIO)
+                dirty = [buf, start & ~0xF, (start + size + 0xF) & ~0xF]
+            else:
+                dirty[1] = min(dirty[1], start & ~0xF)
+                dirty[2] = max(dirty[2], (start + size + 0xF) & ~0xF)
+            dirty[0][start:start + size] = data[pos:pos + size]
+            with self.io_lock:
+                self.writes += 1
+                if self.cache is not None:
+                    self.cache.invalidate(fi['index'], sector)
+                self.dirty[key] = dirty
+            pos += size
+
+        if len(self.dirty) * nand_sector_size > self.writeback_size:
+            self._flush_dirty()
+
+    def _flush_dirty(self):
+        # runs of sectors that are dirty from one to the next are encrypted and written together
+        keys = sorted(self.dirty)
+        while keys:
+            run = [keys.pop(0)]
+            while keys and keys[0] == (run[-1][0], run[-1][1] + 1) and self.dirty[keys[0]][1] == 0 and \
+                    self.dirty[run[-1]][2] == nand_sector_size:
+                run.append(keys.pop(0))
+            fi = self.parts[run[0][0]]
+            first = run[0][1]
+            dirties = [self.dirty[k] for k in run]
+            to_encrypt = bytearray().join(memoryview(d[0])[d[1]:d[2]] for d in dirties)
+            self.crypto[fi['bis_key']].encrypt_into(to_encrypt, first, nand_sector_size, dirties[0][1])
+            with self.io_lock:
+                self._write_raw(fi['start'] + first * nand_sector_size + dirties[0][1], to_encrypt)
+                # the cache is cleared before the dirty sectors go, so a read can't find a stale copy in it
+                self.writes += 1
+                if self.cache is not None:
+                    self.cache.invalidate(fi['index'], first, len(run))
+                for k in run:
+                    del self.dirty[k]
+
+    def sync(self):
+        """Encrypt and write everything that's still only in the write-back buffer."""
+        with self.write_lock:
+            self._flush_dirty()
 
     def __del__(self, *args):
+        if getattr(self, '_stats_stop', None):
+            self._stats_stop.set()
+        if getattr(self, 'dirty', None):
+            self.sync()
+        if getattr(self, 'readahead', None):
+            self.readahead.stop()
+            self.readahead = None
+        if getattr(self, 'map', None) is not None:
+            self.map.close()
+            self.map = None
         try:
             self.f.close()
         except AttributeError:
@@ -78,7 +558,18 @@ class NANDImageMount(LoggingMixIn, Operations):
     destroy = __del__
 
     def flush(self, path, fh):
-        return self.f.flush()
+        self.sync()
+        with self.io_lock:
+            return self.f.flush()
+
+    def fsync(self, path, datasync, fh):
+        self.sync()
+        with self.io_lock:
+            self.f.flush()
+            if self.map is not None:
+                self.map.flush()
+            os.fsync(self.f.fileno())
+        return 0
 
     @_c.ensure_lower_path
     def getattr(self, path: str, fh=None):
@@ -90,29 +581,64 @@ class NANDImageMount(LoggingMixIn, Operations):
             st = {'st_mode': (S_IFREG | (0o444 if self.readonly else 0o666)),
                   'st_size': p['end'] - p['start'], 'st_nlink': 1}
         else:
-            raise FuseOSError(ENOENT)
+            node = self._fat_lookup(path)[1]
+            if node is None:
+                raise FuseOSError(ENOENT)
+            if node.is_dir:
+                st = {'st_mode': S_IFDIR | 0o555, 'st_nlink': 2}
+            else:
+                st = {'st_mode': S_IFREG | 0o444, 'st_size': node.size, 'st_nlink': 1}
+            if node.mtime:
+                return {**st, **self.g_stat, 'st_mtime': node.mtime, 'st_ctime': node.mtime,
+                        'st_uid': uid, 'st_gid': gid}
         return {**st, **self.g_stat, 'st_uid': uid, 'st_gid': gid}
 
     def open(self, path: str, flags):
-        self.fd += 1
-        return self.fd
+        return next(self._fds)
+
+    def release(self, path: str, fh):
+        if self.readahead:
+            self.readahead.forget(fh)
+        return 0
 
     @_c.ensure_lower_path
     def readdir(self, path: str, fh):
         yield from ('.', '..')
-        yield from (x['real_filename'] for x in self.files.values())
+        if path == '/':
+            yield from (x['real_filename'] for x in self.files.values())
+            yield from (x['name'] for x in self.fat_dirs.values())
+            return
+        node = self._fat_lookup(path)[1]
+        if node is None or not node.is_dir:
+            raise FuseOSError(ENOENT)
+        yield from (x.name for x in node.children.values())
 
     @_c.ensure_lower_path
+    @_counted('read')
     def read(self, path: str, size: int, offset: int, fh):
-        fi = self.files[path]
+        fi = self.files.get(path)
+        if fi is None:
+            fi, node = self._fat_lookup(path)
+            if node is None or node.is_dir:
+                raise FuseOSError(ENOENT)
+            # one read per extent, so each is decrypted in one go
+            return b''.join(self._read_partition(fi, o, n, fh) for o, n in node.spans(offset, size))
+        return self._read_partition(fi, offset, size, fh)
+
+    def _read_partition(self, fi: dict, offset: int, size: int, fh) -> bytes:
         real_offset: int = fi['start'] + offset
-
-        if fi['start'] + offset > fi['end']:
+        size = min(size, fi['end'] - real_offset)
+        if size <= 0:
             return b''
-        if offset + size > fi['end']:
-            size = fi['end'] - offset
 
-        if fi['bis_key'] >= 0:
+        if fi['bis_key'] >= 0 and self.cache is not None:
+            data = self._read_cached(fi, offset, size)
+            # fh 0 is a read from write() for the partial blocks, not a reader
+            if self.readahead and fh:
+                self.readahead.access(fh, fi, offset, size)
+            return data
+
+        elif fi['bis_key'] >= 0:
             before = offset % 16
             after = (offset + size) % 16
             if after:
@@ -120,20 +646,34 @@ class NANDImageMount(LoggingMixIn, Operations):
             aligned_real_offset = real_offset - before
             aligned_offset = offset - before
             size = before + size
-            self.f.seek(aligned_real_offset)
-            xtsn = self.crypto[fi['bis_key']]
-            return xtsn.decrypt(self.f.read(size + after), 0, 0x4000, aligned_offset)[before:size]
+            buf = self.read_decrypt(aligned_real_offset, self._get_read_buf(size + after),
+                                    self.crypto[fi['bis_key']], 0, aligned_offset)
+            self._overlay_dirty(fi, aligned_offset, buf)
+            return bytes(buf[before:size])
+
+        elif self.map is not None:
+            return self.map[real_offset:real_offset + size]
+
+        elif hasattr(os, 'pread'):
+            return os.pread(self.f.fileno(), size, real_offset)
 
         else:
-            self.f.seek(real_offset)
-            return self.f.read(size)
+            with self.io_lock:
+                self.f.seek(real_offset)
+                return self.f.read(size)
 
     @_c.ensure_lower_path
+    @_counted('write')
     def write(self, path: str, data: bytes, offset: int, fh):
-        if self.readonly:
+        if self.readonly or path not in self.files:
+            # files in the partition directories are only read
             raise FuseOSError(EROFS)
 
         fi = self.files[path]
+        fat = fi.get('fat')
+        if fat is not None and fat.touches_metadata(offset, len(data)):
+            # built again when it's next looked at, file contents alone don't change the tree
+            fi['fat_stale'] = True
         real_offset: int = fi['start'] + offset
         real_len = len(data)
 
@@ -142,33 +682,44 @@ class NANDImageMount(LoggingMixIn, Operations):
             return real_len
 
         if real_offset + real_len > fi['end']:
-            data = data[:-((real_offset + real_len) - (fi['end'] - fi['start']))]
+            data = data[:fi['end'] - real_offset]
+
+        if fi['bis_key'] >= 0 and self.writeback_size:
+            with self.write_lock:
+                self._write_back(fi, offset, data)
 
-        if fi['bis_key'] >= 0:
+        elif fi['bis_key'] >= 0:
             before = offset % 16
-            after = (offset + real_len) % 16
+            after = (offset + len(data)) % 16
             aligned_offset = offset - before
             aligned_real_offset = real_offset - before
-            if after:
-                # this sucks...
-                new_after = 16 - after
-                last_block_ending = self.read(path, new_after, offset + len(data), 0)
-            else:
-                last_block_ending = b''
-
-            if before:
-                first_block_beginning = self.read(path, before, offset - before, 0)
-            else:
-                first_block_beginning = b''
-
-            self.f.seek(aligned_real_offset)
-            xtsn = self.crypto[fi['bis_key']]
-            to_encrypt = b''.join((first_block_beginning, data, last_block_ending))
-            self.f.write(xtsn.encrypt(to_encrypt, 0, 0x4000, aligned_offset))
+            with self.write_lock:
+                if after:
+                    # this sucks...
+                    new_after = 16 - after
+                    last_block_ending = self.read(path, new_after, offset + len(data), 0)
+                else:
+                    last_block_ending = b''
+
+                if before:
+                    first_block_beginning = self.read(path, before, offset - before, 0)
+                else:
+                    first_block_beginning = b''
+
+                xtsn = self.crypto[fi['bis_key']]
+                to_encrypt = bytearray().join((first_block_beginning, data, last_block_ending))
+                xtsn.encrypt_into(to_encrypt, 0, nand_sector_size, aligned_offset)
+                with self.io_lock:
+                    self._write_raw(aligned_real_offset, to_encrypt)
+                    self.writes += 1
+                    if self.cache is not None:
+                        first = aligned_offset // nand_sector_size
+                        last = (aligned_offset + len(to_encrypt) - 1) // nand_sector_size
+                        self.cache.invalidate(fi['index'], first, last - first + 1)
 
         else:
-            self.f.seek(real_offset)
-            self.f.write(data)
+            with self.io_lock:
+                self._write_raw(real_offset, data)
 
         return real_len
 
@@ -186,17 +737,46 @@ def main(prog: str = None, args: list = None):
     parser = ArgumentParser(prog=prog, description='Mount Nintendo Switch NAND images. Read-only for now.',
                             parents=(_c.default_argp, _c.readonly_argp, _c.main_args('nand', 'NAND image')))
     parser.add_argument('--keys', help='keys text file from biskeydump')
+    parser.add_argument('--cache', type=int, default=32, metavar='MIB',
+                        help='size of the decrypted sector cache in MiB, 0 to disable (default: 32)')
+    parser.add_argument('--readahead', type=int, default=1024, metavar='KIB',
+                        help='how far to decrypt ahead of sequential reads in KiB, 0 to disable (default: 1024)')
+    parser.add_argument('--readahead-trigger', type=int, default=2, metavar='READS',
+                        help='sequential reads on a file before read-ahead starts (default: 2)')
+    parser.add_argument('--write-buffer', type=int, default=4, metavar='MIB',
+                        help='size of the buffer that gathers writes to encrypted partitions in MiB, '
+                             '0 to write through (default: 4)')
+    parser.add_argument('-s', '--single-thread', action='store_true',
+                        help='handle one request at a time instead of running them in parallel')
+    parser.add_argument('--no-mmap', action='store_true', help="don't map the image, read it with regular I/O")
+    parser.add_argument('--io', choices=('auto', 'io_uring', 'pread'), default='auto',
+                        help='how to read the image with --no-mmap or when it can\'t be mapped, auto uses io_uring '
+                             'where the kernel has it (default: auto)')
+    parser.add_argument('--no-fat', action='store_true',
+                        help="don't show the files of the SAFE, SYSTEM and USER partitions as directories")
+    parser.add_argument('--fat-cache', default=default_fat_cache_dir(), metavar='DIR',
+                        help='where to keep the indexes of those partitions between mounts, empty to not keep '
+                             'them (default: %(default)s)')
+    parser.add_argument('--stats', type=float, default=0, metavar='SECONDS',
+                        help='log read/write, cache and decryption counters every SECONDS to stderr '
+                             '(or the --do log), 0 to disable (default: 0)')
 
     a = parser.parse_args(args)
     opts = dict(_c.parse_fuse_opts(a.o))
 
     if a.do:
         logging.basicConfig(level=logging.DEBUG, filename=a.do)
+    elif a.stats:
+        logging.basicConfig(level=logging.INFO, format='%(asctime)s %(message)s')
 
     nand_stat = os.stat(a.nand)
 
     with open(a.nand, 'r+b') as f, open(a.keys, 'r', encoding='utf-8') as k:
-        mount = NANDImageMount(nand_fp=f, g_stat=nand_stat, keys=k.read(), readonly=a.ro)
+        mount = NANDImageMount(nand_fp=f, g_stat=nand_stat, keys=k.read(), readonly=a.ro,
+                               cache_size=a.cache * 1024 * 1024, readahead_size=a.readahead * 1024,
+                               readahead_trigger=a.readahead_trigger, use_mmap=not a.no_mmap,
+                               writeback_size=a.write_buffer * 1024 * 1024, stats_interval=a.stats,
+                               fat=not a.no_fat, fat_cache_dir=a.fat_cache, io_engine=a.io)
         if _c.macos or _c.windows:
             opts['fstypename'] = 'NAND'
             # assuming / is the path separator since macos. but if windows gets support for this,
@@ -207,5 +787,6 @@ def main(prog: str = None, args: list = None):
             elif _c.windows:
                 # volume label can only be up to 32 chars
                 opts['volname'] = 'Nintendo Switch NAND'
-        FUSE(mount, a.mount_point, foreground=a.fg or a.do or a.d, ro=a.ro, nothreads=True, debug=a.d,
+        FUSE(mount, a.mount_point, foreground=a.fg or a.do or a.d, ro=a.ro, nothreads=a.single_thread,
+             debug=a.d,
              fsname=os.path.realpath(a.nand).replace(',', '_'), **opts)
@@ -0,0 +1,508 @@
+"""
+Decrypt the partitions of a NAND image to files, without mounting it.
+
+Each partition is streamed through a pipeline: one thread reads large chunks of the image, a pool of
+workers decrypts them (the extension lets go of the GIL, so they run on every core), and one thread
+writes them out in order. A fixed set of chunk buffers goes around between them, so memory use stays
+the same however big the image is.
+
+Much of SYSTEM and USER is unused and decrypts to zeros. The workers check each decrypted sector for
+that while it's still in cache, and the writer skips those sectors, leaving holes in the output
+instead of writing zeros. Which sectors have data is kept as an allocation bitmap, one bit per
+0x4000 byte sector with the lowest bit first, so later passes can skip the empty ones without
+decrypting anything.
+
+The workers can also hash each chunk with SHA-256 and/or CRC32 in the same pass, so verifying an image
+doesn't mean reading it a second time. With the hashes of every partition and chunk saved in a
+manifest, a later run can check the image against it and point out which chunks changed. A whole
+partition gets sha256_chunked, a hash of its chunks' SHA-256 hashes (see sha256_chunked_scheme) that
+comes from the same pass. It is not the SHA-256 of the partition, so sha256sum won't match it.
+"""
+
+import hashlib
+import json
+import mmap
+import os
+import zlib
+from argparse import ArgumentParser
+from errno import EINVAL
+from functools import lru_cache
+from queue import Queue
+from sys import argv, exit, stderr
+from threading import Thread
+from time import perf_counter
+from typing import TYPE_CHECKING
+
+from crypto import XTSN, ImageReader, parse_biskeydump, zero_map
+from gpt import GPTError, read_partitions
+
+if TYPE_CHECKING:
+    from typing import Dict, Iterator, List, Optional, Sequence, Tuple
+
+# the XTS sector size of the encrypted partitions
+nand_sector_size = 0x4000
+# O_DIRECT needs buffers, offsets and sizes aligned to the logical block size, this covers all of them
+direct_align = 0x1000
+# chunks are decrypted, checked for zeros and hashed this much at a time, so each piece is still in
+# cache after decrypting. a multiple of 8 sectors, so the pieces' bitmaps join up byte by byte
+piece_size = 16 * nand_sector_size
+hash_names = ('sha256', 'crc32')
+# a partition's sha256_chunked is over the chunk size and partition size as 64-bit little endian, then the
+# digest of each chunk in order. the workers hash the chunks in parallel, so nothing is hashed twice
+sha256_chunked_scheme = 'sha256(u64le chunk_size || u64le size || sha256(chunk 0) || sha256(chunk 1) || ...)'
+# what each of hash_names is saved as for a whole partition
+partition_hash_names = {'sha256': 'sha256_chunked', 'crc32': 'crc32'}
+# bumped when the manifest format changes
+manifest_version = 3
+
+
+def _round_up(n: int, align: int) -> int:
+    return (n + align - 1) // align * align
+
+
+def allocated_ranges(bitmap: bytes, size: int) -> 'Iterator[Tuple[int, int]]':
+    """(offset, length) of each run of sectors with data in an allocation bitmap of a size byte partition."""
+    sectors = (size + nand_sector_size - 1) // nand_sector_size
+    i = 0
+    while i < sectors:
+        if not bitmap[i // 8] & (1 << (i % 8)):
+            i += 1
+            continue
+        start = i
+        while i < sectors and bitmap[i // 8] & (1 << (i % 8)):
+            i += 1
+        yield start * nand_sector_size, min(i * nand_sector_size, size) - start * nand_sector_size
+
+
+def _gf2_times(mat: 'Sequence[int]', vec: int) -> int:
+    ret = 0
+    i = 0
+    while vec:
+        if vec & 1:
+            ret ^= mat[i]
+        vec >>= 1
+        i += 1
+    return ret
+
+
+@lru_cache(maxsize=None)
+def _crc32_zeros(length: int) -> 'Tuple[int, ...]':
+    # the matrix over GF(2) that takes a crc past length zero bytes, made by squaring as in zlib's
+    # crc32_combine. chunks are mostly the same size, so there's usually only one of these
+    op = [1 << n for n in range(32)]
+    power = [0xEDB88320] + [1 << n for n in range(31)]
+    for _ in range(3):
+        power = [_gf2_times(power, c) for c in power]
+    while length:
+        if length & 1:
+            op = [_gf2_times(power, c) for c in op]
+        length >>= 1
+        if length:
+            power = [_gf2_times(power, c) for c in power]
+    return tuple(op)
+
+
+def crc32_combine(crc1: int, crc2: int, len2: int) -> int:
+    """The CRC32 of two pieces of data one after the other, from their CRC32s and the second one's length."""
+    return _gf2_times(_crc32_zeros(len2), crc1) ^ crc2
+
+
+def _pwrite_all(fd: int, view: memoryview, offset: int):
+    if not hasattr(os, 'pwrite'):
+        os.lseek(fd, offset, os.SEEK_SET)
+    while view:
+        written = os.pwrite(fd, view, offset) if hasattr(os, 'pwrite') else os.write(fd, view)
+        view = view[written:]
+        offset += written
+
+
+def open_direct(path: str, flags: int, direct: bool) -> 'Tuple[int, bool]':
+    """os.open, with O_DIRECT when asked for and the OS and file system take it. Returns the fd and if it did."""
+    flags |= getattr(os, 'O_BINARY', 0)
+    if direct and hasattr(os, 'O_DIRECT'):
+        try:
+            return os.open(path, flags | os.O_DIRECT, 0o666), True
+        except OSError as e:
+            if e.errno != EINVAL:
+                raise
+            print(f'{path}: O_DIRECT is not supported here, using buffered I/O', file=stderr)
+    elif direct:
+        print('O_DIRECT is not available on this OS, using buffered I/O', file=stderr)
+    return os.open(path, flags, 0o666), False
+
+
+class PartitionDump:
+    """
+    One partition going through the pipeline. Chunk k is the partition's bytes from k * chunk_size,
+    and a chunk's buffer travels reader -> work queue -> a worker -> done queue -> writer -> free queue.
+    """
+
+    def __init__(self, src: ImageReader, src_direct: bool, part: dict, xtsn: 'Optional[XTSN]',
+                 out_fd: 'Optional[int]', out_direct: bool, chunk_size: int, workers: int, sparse: bool = True,
+                 hashes: 'Sequence[str]' = ()):
+        self.src = src
+        self.part = part
+        self.xtsn = xtsn
+        self.out_fd = out_fd
+        self.out_direct = out_direct
+        self.chunk_size = chunk_size
+        self.workers = workers
+        self.size = part['end'] - part['start']
+        self.chunks = (self.size + chunk_size - 1) // chunk_size
+        self.sparse = sparse
+        # bit n is set if sector n has any data
+        self.bitmap = bytearray(((self.size + nand_sector_size - 1) // nand_sector_size + 7) // 8)
+        self.used = 0
+        # name: hex digest of each chunk, and of the whole partition once it's done
+        self.hashes = tuple(hashes)
+        self.chunk_hashes: Dict[str, List[str]] = {h: [None] * self.chunks for h in self.hashes}
+        self.digests: Dict[str, str] = {}
+        # the chunk digests have to go in in order, the writer adds them as chunks come by
+        self._sha256 = hashlib.sha256(chunk_size.to_bytes(8, 'little') + self.size.to_bytes(8, 'little')) \
+            if 'sha256' in self.hashes else None
+        self._crc32 = 0
+        # with O_DIRECT reads start at the aligned offset before the partition, and the data is this far in
+        self.head = part['start'] % direct_align if src_direct else 0
+        self.read_align = direct_align if src_direct else 1
+        # two buffers per worker keep the reader and writer busy while the workers are
+        self.free = Queue()
+        for _ in range(workers * 2 + 2):
+            # anonymous mappings are page aligned, as O_DIRECT needs
+            self.free.put(mmap.mmap(-1, chunk_size + direct_align))
+        self.work = Queue()
+        self.done = Queue()
+        self.error: Optional[BaseException] = None
+
+    def _fail(self, e: BaseException):
+        if self.error is None:
+            self.error = e
+
+    def _read(self):
+        try:
+            for k in range(self.chunks):
+                buf = self.free.get()
+                if self.error is not None:
+                    break
+                n = min(self.chunk_size, self.size - k * self.chunk_size)
+                want = _round_up(self.head + n, self.read_align)
+                # with io_uring the chunk is read as many pieces at once, short only at the end of the image
+                with memoryview(buf)[:want] as view:
+                    got = self.src.read_decrypt(self.part['start'] - self.head + k * self.chunk_size, view)
+                if got < self.head + n:
+                    raise EOFError(f'{self.part["name"]}: the image ends before the partition does')
+                self.work.put((k, buf, n))
+        except BaseException as e:
+            self._fail(e)
+        finally:
+            for _ in range(self.workers):
+                self.work.put(None)
+
+    def _crypt(self):
+        while True:
+            item = self.work.get()
+            if item is None:
+                self.done.put(None)
+                return
+            k, buf, n = item
+            bits = used = digests = None
+            try:
+                if self.error is None:
+                    bits, used, digests = self._crypt_chunk(k, memoryview(buf), n)
+            except BaseException as e:
+                self._fail(e)
+            self.done.put((k, buf, n, bits, used, digests))
+
+    def _crypt_chunk(self, k: int, view: memoryview, n: int) -> 'Tuple[bytearray, int, Dict[str, object]]':
+        bits = bytearray()
+        used = 0
+        sha256 = hashlib.sha256() if 'sha256' in self.hashes else None
+        crc = 0
+        for pos in range(0, n, piece_size):
+            size = min(piece_size, n - pos)
+            piece = view[pos:pos + size]
+            # the data ends up at the start of the buffer, which O_DIRECT writes need
+            if self.xtsn is not None:
+                self.xtsn.decrypt_into(view[self.head + pos:self.head + pos + size],
+                                       (k * self.chunk_size + pos) // nand_sector_size, nand_sector_size,
+                                       threads=1, out=piece if self.head else None)
+            elif self.head:
+                piece[:] = view[self.head + pos:self.head + pos + size]
+            # checked and hashed here while the piece is still in cache, and on every core
+            piece_bits, piece_used = zero_map(piece, nand_sector_size)
+            bits += piece_bits
+            used += piece_used
+            if sha256 is not None:
+                sha256.update(piece)
+            if 'crc32' in self.hashes:
+                crc = zlib.crc32(piece, crc)
+        digests = {}
+        if sha256 is not None:
+            digests['sha256'] = sha256
+        if 'crc32' in self.hashes:
+            digests['crc32'] = crc
+        return bits, used, digests
+
+    def _write(self):
+        pending = {}
+        finished = 0
+        next_chunk = 0
+        while finished < self.workers:
+            item = self.done.get()
+            if item is None:
+                finished += 1
+                continue
+            pending[item[0]] = item
+            while next_chunk in pending:
+                k, buf, n, bits, used, digests = pending.pop(next_chunk)
+                try:
+                    if self.error is None:
+                        self._add_bits(k, bits, used)
+                        self._add_digests(k, n, digests)
+                        if self.out_fd is not None:
+                            self._write_chunk(k, buf, n, bits)
+                except BaseException as e:
+                    self._fail(e)
+                self.free.put(buf)
+                next_chunk += 1
+
+    def _add_bits(self, k: int, bits: bytes, used: int):
+        first = k * self.chunk_size // nand_sector_size
+        self.used += used
+        if first % 8 == 0:
+            self.bitmap[first // 8:first // 8 + len(bits)] = bits
+            return
+        for i in range(len(bits) * 8):
+            if bits[i // 8] & (1 << (i % 8)):
+                self.bitmap[(first + i) // 8] |= 1 << ((first + i) % 8)
+
+    def _add_digests(self, k: int, n: int, digests: 'Dict[str, object]'):
+        if 'sha256' in digests:
+            digest = digests['sha256'].digest()
+            self.chunk_hashes['sha256'][k] = digest.hex()
+            self._sha256.update(digest)
+        if 'crc32' in digests:
+            self.chunk_hashes['crc32'][k] = f'{digests["crc32"]:08x}'
+            self._crc32 = crc32_combine(self._crc32, digests['crc32'], n)
+
+    def _write_chunk(self, k: int, buf: mmap.mmap, n: int, bits: bytes):
+        if self.sparse:
+            for offset, length in allocated_ranges(bits, n):
+                self._write_range(k, buf, offset, length)
+        else:
+            self._write_range(k, buf, 0, n)
+
+    def _write_range(self, k: int, buf: mmap.mmap, offset: int, length: int):
+        # the last chunk is padded to a whole block for O_DIRECT and cut off afterwards
+        end = _round_up(offset + length, direct_align) if self.out_direct else offset + length
+        _pwrite_all(self.out_fd, memoryview(buf)[offset:end], k * self.chunk_size + offset)
+
+    def run(self):
+        threads = [Thread(target=self._read, name='nanddump-read'),
+                   Thread(target=self._write, name='nanddump-write')]
+        threads += [Thread(target=self._crypt, name='nanddump-crypt') for _ in range(self.workers)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        if self.error is not None:
+            raise self.error
+        if self._sha256 is not None:
+            self.digests['sha256_chunked'] = self._sha256.hexdigest()
+        if 'crc32' in self.hashes:
+            self.digests['crc32'] = f'{self._crc32:08x}'
+        # also makes the file its full size when it ends in a hole
+        if self.out_fd is not None and (self.out_direct or self.sparse):
+            os.ftruncate(self.out_fd, self.size)
+
+
+def _run(nand_path: str, keys: str, names: 'Optional[List[str]]', workers: int, chunk_size: int,
+         direct_read: bool, out_dir: 'Optional[str]', direct_write: bool, sparse: bool,
+         hashes: 'Sequence[str]', io_engine: str = 'auto') -> 'List[PartitionDump]':
+    # every partition through the pipeline, written to out_dir unless it's None
+    if chunk_size <= 0 or chunk_size % nand_sector_size:
+        raise ValueError(f'chunk size must be a multiple of {nand_sector_size:#x}')
+    unknown = set(hashes) - set(hash_names)
+    if unknown:
+        raise ValueError('Unknown hashes: ' + ', '.join(sorted(unknown)))
+    workers = workers or os.cpu_count() or 1
+    bis_keys = parse_biskeydump(keys)
+    crypto = [XTSN(*bis_keys[x]) for x in range(4)]
+
+    with open(nand_path, 'rb') as f:
+        partitions = [p for p in read_partitions(f) if p['name'] and p['end'] > p['start']]
+    if names:
+        wanted = {n.upper() for n in names}
+        missing = wanted - {p['name'].upper() for p in partitions}
+        if missing:
+            raise ValueError('Partitions not found: ' + ', '.join(sorted(missing)))
+        partitions = [p for p in partitions if p['name'].upper() in wanted]
+
+    src_fd, src_direct = open_direct(nand_path, os.O_RDONLY, direct_read)
+    if hasattr(os, 'posix_fadvise') and not src_direct:
+        os.posix_fadvise(src_fd, 0, 0, os.POSIX_FADV_SEQUENTIAL)
+    done = []
+    total = 0
+    total_start = perf_counter()
+    try:
+        src = ImageReader(src_fd, io_engine)
+        for part in partitions:
+            out_fd = out_direct = None
+            if out_dir is not None:
+                out_path = os.path.join(out_dir, part['name'] + '.img')
+                out_fd, out_direct = open_direct(out_path, os.O_WRONLY | os.O_CREAT | os.O_TRUNC, direct_write)
+            try:
+                start = perf_counter()
+                xtsn = crypto[part['bis_key']] if part['bis_key'] >= 0 else None
+                part_dump = PartitionDump(src, src_direct, part, xtsn, out_fd, out_direct, chunk_size, workers,
+                                          sparse, hashes)
+                part_dump.run()
+            finally:
+                if out_fd is not None:
+                    os.close(out_fd)
+            done.append(part_dump)
+            size = part['end'] - part['start']
+            elapsed = perf_counter() - start
+            total += size
+            print(f'{part["name"]}: {size / 0x100000:.1f} MiB in {elapsed:.2f}s '
+                  f'({size / 0x100000 / max(elapsed, 1e-9):.1f} MiB/s), '
+                  f'{part_dump.used * nand_sector_size / 0x100000:.1f} MiB used')
+            for name, digest in part_dump.digests.items():
+                print(f'  {name}: {digest}')
+    finally:
+        os.close(src_fd)
+    elapsed = perf_counter() - total_start
+    print(f'Total: {total / 0x100000:.1f} MiB in {elapsed:.2f}s ({total / 0x100000 / max(elapsed, 1e-9):.1f} MiB/s)')
+    return done
+
+
+def write_manifest(path: str, nand_path: str, chunk_size: int, hashes: 'Sequence[str]',
+                   dumps: 'List[PartitionDump]'):
+    """Save the hashes of each partition and each of its chunks as JSON."""
+    st = os.stat(nand_path)
+    manifest = {'version': manifest_version,
+                'image': {'path': os.path.realpath(nand_path), 'size': st.st_size, 'mtime_ns': st.st_mtime_ns},
+                'chunk_size': chunk_size, 'hashes': list(hashes), 'partitions': {}}
+    if 'sha256' in hashes:
+        manifest['sha256_chunked_scheme'] = sha256_chunked_scheme
+    for d in dumps:
+        manifest['partitions'][d.part['name']] = {'start': d.part['start'], 'size': d.size,
+                                                  'used_sectors': d.used, **d.digests, 'chunks': d.chunk_hashes}
+    with open(path, 'w', encoding='utf-8') as f:
+        json.dump(manifest, f, indent=1)
+
+
+def dump(nand_path: str, keys: str, out_dir: str, names: 'List[str]' = None, workers: int = 0,
+         chunk_size: int = 8 * 1024 * 1024, direct_read: bool = False, direct_write: bool = False,
+         sparse: bool = True, write_bitmaps: bool = False, hashes: 'Sequence[str]' = (),
+         manifest: str = None, io_engine: str = 'auto') -> 'Dict[str, bytearray]':
+    """
+    Decrypt the partitions in names (all of them when None) from the image to <name>.img files in out_dir.
+    Returns the allocation bitmap of each, which are also written to <name>.bitmap with write_bitmaps.
+    With a manifest path, the hashes named in hashes are saved there. io_engine is how the image is read,
+    auto, io_uring or pread.
+    """
+    dumps = _run(nand_path, keys, names, workers, chunk_size, direct_read, out_dir, direct_write, sparse, hashes,
+                 io_engine)
+    if write_bitmaps:
+        for d in dumps:
+            with open(os.path.join(out_dir, d.part['name'] + '.bitmap'), 'wb') as b:
+                b.write(d.bitmap)
+    if manifest:
+        write_manifest(manifest, nand_path, chunk_size, hashes, dumps)
+    return {d.part['name']: d.bitmap for d in dumps}
+
+
+def verify(nand_path: str, keys: str, manifest: str, names: 'List[str]' = None, workers: int = 0,
+           direct_read: bool = False, new_manifest: str = None, io_engine: str = 'auto') -> bool:
+    """
+    Check the partitions against a manifest from an earlier dump, printing the offsets of the chunks that
+    changed. Nothing is written, except the image's current hashes to new_manifest if it's given.
+    """
+    with open(manifest, 'r', encoding='utf-8') as f:
+        expected = json.load(f)
+    if expected.get('version') != manifest_version:
+        raise ValueError(f'{manifest}: unsupported manifest version {expected.get("version")}')
+    chunk_size = expected['chunk_size']
+    hashes = expected['hashes']
+    if not names:
+        names = list(expected['partitions'])
+    dumps = _run(nand_path, keys, names, workers, chunk_size, direct_read, None, False, False, hashes, io_engine)
+    if new_manifest:
+        write_manifest(new_manifest, nand_path, chunk_size, hashes, dumps)
+
+    ok = True
+    for d in dumps:
+        name = d.part['name']
+        exp = expected['partitions'].get(name)
+        if exp is None:
+            print(f'{name}: not in the manifest')
+            ok = False
+            continue
+        if exp['size'] != d.size:
+            print(f'{name}: size changed from {exp["size"]:#x} to {d.size:#x}')
+            ok = False
+            continue
+        changed = [k for k in range(d.chunks) if any(exp['chunks'][h][k] != d.chunk_hashes[h][k] for h in hashes)]
+        if changed:
+            ok = False
+            print(f'{name}: {len(changed)} of {d.chunks} chunks changed:')
+            for k in changed:
+                print(f'  {k * chunk_size:#x}-{min((k + 1) * chunk_size, d.size):#x}')
+        elif any(exp[partition_hash_names[h]] != d.digests[partition_hash_names[h]] for h in hashes):
+            print(f'{name}: hash mismatch')
+            ok = False
+        else:
+            print(f'{name}: ok')
+    return ok
+
+
+def main(prog: str = None, args: list = None):
+    if args is None:
+        args = argv[1:]
+    parser = ArgumentParser(prog=prog, description='Decrypt the partitions of a Nintendo Switch NAND image to files.')
+    parser.add_argument('nand', help='NAND image')
+    parser.add_argument('--keys', required=True, help='keys text file from biskeydump')
+    parser.add_argument('-o', '--out', default='.', metavar='DIR', help='directory to write to (default: .)')
+    parser.add_argument('-p', '--partition', action='append', metavar='NAME',
+                        help='partition to dump, can be given more than once (default: all)')
+    parser.add_argument('-t', '--threads', type=int, default=0,
+                        help='decryption threads (default: one per CPU)')
+    parser.add_argument('--chunk-size', type=int, default=8, metavar='MIB',
+                        help='size of each read, decrypt and write in MiB (default: 8)')
+    parser.add_argument('--direct', action='store_true', help='use O_DIRECT for both reading and writing')
+    parser.add_argument('--direct-read', action='store_true', help='use O_DIRECT for reading the image')
+    parser.add_argument('--direct-write', action='store_true', help='use O_DIRECT for writing the partitions')
+    parser.add_argument('--io', choices=('auto', 'io_uring', 'pread'), default='auto',
+                        help='how to read the image, auto uses io_uring where the kernel has it (default: auto)')
+    parser.add_argument('--no-sparse', action='store_true',
+                        help='write sectors that decrypt to zeros instead of leaving holes in the files')
+    parser.add_argument('--bitmap', action='store_true',
+                        help='write which 0x4000 byte sectors have data to <name>.bitmap, lowest bit first')
+    parser.add_argument('--hash', action='append', choices=hash_names,
+                        help='hash the partitions and each chunk of them while decrypting, can be given more than '
+                             'once. a whole partition gets sha256_chunked, a hash of its chunk hashes, not its '
+                             'SHA-256 (default with --manifest: all of them)')
+    parser.add_argument('--manifest', metavar='FILE', help='write the hashes to FILE as JSON')
+    parser.add_argument('--verify', metavar='MANIFEST',
+                        help="don't write the partitions, check them against the hashes in MANIFEST from an earlier "
+                             "--manifest run and list the chunks that changed. --chunk-size and --hash come from it")
+
+    a = parser.parse_args(args)
+    with open(a.keys, 'r', encoding='utf-8') as k:
+        keys = k.read()
+    try:
+        if a.verify:
+            return 0 if verify(a.nand, keys, a.verify, a.partition, a.threads, a.direct or a.direct_read,
+                               a.manifest, a.io) else 1
+        os.makedirs(a.out, exist_ok=True)
+        hashes = a.hash or (hash_names if a.manifest else ())
+        dump(a.nand, keys, a.out, a.partition, a.threads, a.chunk_size * 1024 * 1024,
+             a.direct or a.direct_read, a.direct or a.direct_write, not a.no_sparse, a.bitmap, hashes, a.manifest,
+             a.io)
+    except (GPTError, ValueError, OSError) as e:
+        exit(str(e))
+    return 0
+
+
+if __name__ == '__main__':
+    exit(main())
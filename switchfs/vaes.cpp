@@ -0,0 +1,130 @@
+/*
+ * AES-128 XTS using VAES and AVX-512, see vaes.h.
+ *
+ * Like aesni.cpp, the functions are compiled for their target individually,
+ * so nothing else needs -mavx512f and the extension still loads without it.
+ */
+extern "C" {
+#include "vaes.h"
+}
+
+#ifdef VAES_BUILD
+
+#include <string.h>
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define VAES_TARGET __attribute__((target("aes,sse2,avx512f,vaes")))
+
+#ifndef __clang__
+//gcc's own _mm512_undefined_epi32 trips these when the intrinsics are inlined into a target function
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+extern "C" {
+
+int vaes_supported(void) {
+    unsigned int eax, ebx, ecx, edx, xcr0_lo, xcr0_hi;
+    if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return 0;
+    //aes-ni for the tail blocks, and osxsave so xgetbv can be asked
+    if(!((ecx >> 25) & 1) || !((ecx >> 27) & 1)) return 0;
+    if(!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return 0;
+    //avx512f and vaes
+    if(!((ebx >> 16) & 1) || !((ecx >> 9) & 1)) return 0;
+    __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    //the os has to save xmm, ymm, the opmasks and all of the zmm registers
+    return (xcr0_lo & 0xE6) == 0xE6;
+}
+
+//multiplies each of the four tweaks by alpha^4. per 128-bit lane the top four bits of the low
+//qword move up into the high one, and the top four of the high qword get folded back into the
+//low one as bits * (x^7 + x^2 + x + 1)
+#define VAES_TWEAKS_MUL4(v) do { \
+    __m512i c = _mm512_srli_epi64(v, 60); \
+    __m512i r = _mm512_unpackhi_epi64(c, _mm512_setzero_si512()); \
+    v = _mm512_xor_si512(_mm512_slli_epi64(v, 4), _mm512_unpacklo_epi64(_mm512_setzero_si512(), c)); \
+    v = _mm512_xor_si512(v, _mm512_xor_si512(_mm512_xor_si512(r, _mm512_slli_epi64(r, 1)), \
+                                             _mm512_xor_si512(_mm512_slli_epi64(r, 2), _mm512_slli_epi64(r, 7)))); \
+} while(0)
+
+VAES_TARGET
+void vaes_xts_tweaks(uint8_t *tweak, uint8_t *out, size_t count) {
+    uint64_t t[8];
+    size_t i;
+    __m512i v;
+
+    memcpy(t, tweak, 16);
+    //the first four are doubled one at a time, after that it's four steps of alpha^4
+    for (i = 1; i < 4 && i <= count; ++i) {
+        uint64_t carry = (0 - (t[i * 2 - 1] >> 63)) & 0x87;
+        t[i * 2 + 1] = (t[i * 2 - 1] << 1) | (t[i * 2 - 2] >> 63);
+        t[i * 2] = (t[i * 2 - 2] << 1) ^ carry;
+    }
+    if(count < 4) {
+        memcpy(out, t, count * 16);
+        memcpy(tweak, t + count * 2, 16);
+        return;
+    }
+
+    v = _mm512_loadu_si512(t);
+    for (i = 0; i + 4 <= count; i += 4) {
+        _mm512_storeu_si512(out + i * 16, v);
+        VAES_TWEAKS_MUL4(v);
+    }
+    _mm512_storeu_si512(t, v);
+    memcpy(out + i * 16, t, (count - i) * 16);
+    memcpy(tweak, t + (count - i) * 2, 16);
+}
+
+#define VAES_ROUND_X4(op, b, k) do { \
+    b[0] = op(b[0], k); b[1] = op(b[1], k); b[2] = op(b[2], k); b[3] = op(b[3], k); \
+} while(0)
+
+//sixteen blocks in four registers at a time, then four at a time, then aes-ni for what's left.
+//unlike aes-ni there are enough registers to keep the tweaks around for the final xor
+#define VAES_XTS_BLOCKS(aesround, aeslast, aesni_tail) do { \
+    const __m128i *rk = (const __m128i *)roundkeys; \
+    __m512i k[11], b[4], tw[4]; \
+    int i, j; \
+    for (i = 0; i < 11; ++i) { \
+        k[i] = _mm512_broadcast_i32x4(_mm_loadu_si128(rk + i)); \
+    } \
+    for (; blocks >= 16; blocks -= 16, data += 256, tweaks += 256) { \
+        for (j = 0; j < 4; ++j) { \
+            tw[j] = _mm512_loadu_si512(tweaks + j * 64); \
+            b[j] = _mm512_xor_si512(_mm512_xor_si512(_mm512_loadu_si512(data + j * 64), tw[j]), k[0]); \
+        } \
+        for (i = 1; i < 10; ++i) { \
+            VAES_ROUND_X4(aesround, b, k[i]); \
+        } \
+        VAES_ROUND_X4(aeslast, b, k[10]); \
+        for (j = 0; j < 4; ++j) { \
+            _mm512_storeu_si512(data + j * 64, _mm512_xor_si512(b[j], tw[j])); \
+        } \
+    } \
+    for (; blocks >= 4; blocks -= 4, data += 64, tweaks += 64) { \
+        tw[0] = _mm512_loadu_si512(tweaks); \
+        b[0] = _mm512_xor_si512(_mm512_xor_si512(_mm512_loadu_si512(data), tw[0]), k[0]); \
+        for (i = 1; i < 10; ++i) { \
+            b[0] = aesround(b[0], k[i]); \
+        } \
+        _mm512_storeu_si512(data, _mm512_xor_si512(aeslast(b[0], k[10]), tw[0])); \
+    } \
+    if (blocks) aesni_tail(roundkeys, data, tweaks, blocks); \
+} while(0)
+
+VAES_TARGET
+void vaes_xts_encrypt_128_blocks(const uint8_t *roundkeys, uint8_t *data, const uint8_t *tweaks, size_t blocks) {
+    VAES_XTS_BLOCKS(_mm512_aesenc_epi128, _mm512_aesenclast_epi128, aesni_xts_encrypt_128_blocks);
+}
+
+VAES_TARGET
+void vaes_xts_decrypt_128_blocks(const uint8_t *dec_roundkeys, uint8_t *data, const uint8_t *tweaks, size_t blocks) {
+    const uint8_t *roundkeys = dec_roundkeys;
+    VAES_XTS_BLOCKS(_mm512_aesdec_epi128, _mm512_aesdeclast_epi128, aesni_xts_decrypt_128_blocks);
+}
+
+} //extern
+
+#endif
@@ -0,0 +1,57 @@
+/*
+ * AES-128 XTS using the VAES instructions on 512-bit registers, four blocks per instruction.
+ *
+ * Round keys use the same layout as aesni.h.
+ * Blocks that don't fill a whole register at the end go through the AES-NI functions.
+ *
+ * Nothing in here may be called unless vaes_supported() returned non-zero.
+ */
+#ifndef VAES_128_H
+#define VAES_128_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "aesni.h"
+
+#if defined AESNI_BUILD && (defined __x86_64__ || defined _M_X64) && \
+    ((defined __GNUC__ && __GNUC__ >= 8) || (defined __clang__ && __clang_major__ >= 6))
+#define VAES_BUILD 1
+
+/**
+ * @purpose:            Check through cpuid and xgetbv if the CPU has AES-NI, VAES and AVX-512F,
+ *                      and that the OS saves the AVX-512 registers.
+ * @return:             non-zero if the functions below may be used
+ */
+int vaes_supported(void);
+
+/**
+ * @purpose:                Write count consecutive XTS tweaks, doubling four at once in a register
+ * @par[in,out]tweak:       16 bytes, the first tweak. Replaced with the one after the last written
+ * @par[out]out:            count * 16 bytes
+ * @par[in]count:           number of tweaks
+ */
+void vaes_xts_tweaks(uint8_t *tweak, uint8_t *out, size_t count);
+
+/**
+ * @purpose:            In-place XTS style encryption of many consecutive blocks, see aesni_xts_encrypt_128_blocks.
+ *                      Sixteen blocks are kept in flight at once
+ * @par[in]roundkeys:   round keys from aes_key_schedule_128
+ * @par[in,out]data:    blocks * 16 bytes
+ * @par[in]tweaks:      blocks * 16 bytes, one tweak per block
+ * @par[in]blocks:      number of blocks
+ */
+void vaes_xts_encrypt_128_blocks(const uint8_t *roundkeys, uint8_t *data, const uint8_t *tweaks, size_t blocks);
+
+/**
+ * @purpose:                In-place XTS style decryption of many consecutive blocks, see vaes_xts_encrypt_128_blocks
+ * @par[in]dec_roundkeys:   round keys from aes_decrypt_key_schedule_128
+ * @par[in,out]data:        blocks * 16 bytes
+ * @par[in]tweaks:          blocks * 16 bytes, one tweak per block
+ * @par[in]blocks:          number of blocks
+ */
+void vaes_xts_decrypt_128_blocks(const uint8_t *dec_roundkeys, uint8_t *data, const uint8_t *tweaks, size_t blocks);
+
+#endif
+
+#endif
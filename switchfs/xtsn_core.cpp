@@ -0,0 +1,1263 @@
+/*
+ * Nintendo AES-XTSN, see xtsn_core.h.
+ *
+ * Every backend is an instance of the XTSN template, made of a function crypting many blocks with
+ * their tweaks and one for the single block sector tweaks. Calls go through the context's entry in the
+ * backend table, or the global one xtsn_init picked.
+ */
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <inttypes.h>
+#include <mutex>
+#include <new>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include "aes.h"
+#include "aes_ct.h"
+#include "aesni.h"
+#include "armv8.h"
+#include "vaes.h"
+#include "xtsn_core.h"
+
+//SSE2 is part of x86-64 and NEON of AArch64, so the zero check uses them without a cpuid check
+#if defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define ZERO_SSE2 1
+#elif defined __aarch64__ || defined _M_ARM64
+#include <arm_neon.h>
+#define ZERO_NEON 1
+#endif
+}
+
+#if defined _WIN16 || defined _WIN32 || defined _WIN64
+#include <windows.h>
+typedef HMODULE DYHandle;
+#ifdef _WIN64
+#define LIBCRYPTO "libcrypto-1_1-x64.dll"
+#else
+#define LIBCRYPTO "libcrypto-1_1.dll"
+#endif
+#elif defined __linux__ || (defined __APPLE__ && defined __MACH__)
+#include <dlfcn.h>
+typedef void* DYHandle;
+#define WINAPI
+#ifdef __linux__
+#define LIBCRYPTO "libcrypto.so"
+#else
+#define LIBCRYPTO "libcrypto.dylib"
+#endif
+#endif
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+const static union {
+    u16 foo;
+    u8 islittle;
+} endian = {(u16)0x001};
+
+inline static u64 be64(u64 var) {
+    if(endian.islittle) {
+        #if defined __clang__ || defined __GNUC__
+        var = __builtin_bswap64(var);
+        #elif defined _MSC_VER
+        var = _byteswap_uint64(var);
+        #else
+        u64 tmp = var;
+        ((u8 *) &var)[7] = ((u8 *) &tmp)[0];
+        ((u8 *) &var)[6] = ((u8 *) &tmp)[1];
+        ((u8 *) &var)[5] = ((u8 *) &tmp)[2];
+        ((u8 *) &var)[4] = ((u8 *) &tmp)[3];
+        ((u8 *) &var)[3] = ((u8 *) &tmp)[4];
+        ((u8 *) &var)[2] = ((u8 *) &tmp)[5];
+        ((u8 *) &var)[1] = ((u8 *) &tmp)[6];
+        ((u8 *) &var)[0] = ((u8 *) &tmp)[7];
+        #endif
+    }
+    return var;
+}
+
+inline static u64 le64(u64 var) {
+    if(!endian.islittle) {
+        #if defined __clang__ || defined __GNUC__
+        var = __builtin_bswap64(var);
+        #elif defined _MSC_VER
+        var = _byteswap_uint64(var);
+        #else
+        //sacrifice code size for possible speed up
+        u64 tmp = var;
+        ((u8 *) &var)[7] = ((u8 *) &tmp)[0];
+        ((u8 *) &var)[6] = ((u8 *) &tmp)[1];
+        ((u8 *) &var)[5] = ((u8 *) &tmp)[2];
+        ((u8 *) &var)[4] = ((u8 *) &tmp)[3];
+        ((u8 *) &var)[3] = ((u8 *) &tmp)[4];
+        ((u8 *) &var)[2] = ((u8 *) &tmp)[5];
+        ((u8 *) &var)[1] = ((u8 *) &tmp)[6];
+        ((u8 *) &var)[0] = ((u8 *) &tmp)[7];
+        #endif
+    }
+    return var;
+}
+
+class DynamicHelper {
+    DYHandle handle;
+public:
+    inline bool LoadLib(const char *name) {
+        #if defined _WIN16 || defined _WIN32 || defined _WIN64
+        handle = LoadLibraryExA(name, NULL, LOAD_LIBRARY_SEARCH_DEFAULT_DIRS);
+        #elif defined __linux__ || (defined __APPLE__ && defined __MACH__)
+        handle = dlopen(name, RTLD_NOW);
+        #endif
+        return handle != NULL;
+    }
+    inline void Unload() {
+        if(handle) {
+            #if defined _WIN16 || defined _WIN32 || defined _WIN64
+            FreeLibrary(handle);
+            #elif defined __linux__ || (defined __APPLE__ && defined __MACH__)
+            dlclose(handle);
+            #endif
+            handle = 0;
+        }
+    }
+    inline void GetFunctionPtr(const char* name, void** ptr) {
+        *ptr = NULL;
+        #if defined _WIN16 || defined _WIN32 || defined _WIN64
+        *ptr = (void*)GetProcAddress(handle, name);
+        #elif defined __linux__ || (defined __APPLE__ && defined __MACH__)
+        *ptr = dlsym(handle, name);
+        #endif
+    }
+    inline bool HasHandle() {return handle != NULL;}
+    DynamicHelper() : handle(0) {}
+    ~DynamicHelper() {Unload();}
+};
+
+class bigint128 {
+public:
+    union {
+        u8 v8[16];
+        u64 v64[2];
+    };
+};
+
+class SectorOffset : public bigint128 {
+public:
+    inline u64* Lo() {return &v64[0];}
+    inline u64* Hi() {return &v64[1];}
+    inline void Step() {
+        if (v64[0] > (v64[0] + 1LLU)) v64[1] += 1LLU;
+        v64[0] += 1LLU;
+    }
+    inline void Step(u64 amount) {
+        if (v64[0] > (v64[0] + amount)) v64[1] += 1LLU;
+        v64[0] += amount;
+    }
+};
+
+//writes tweak and the next count - 1 tweaks to out, then moves it past them.
+//done in registers, storing and reloading the tweak every block stalls on store forwarding
+inline static void fill_tweaks(bigint128& tweak, bigint128* out, u64 count) {
+    u64 lo = le64(tweak.v64[0]);
+    u64 hi = le64(tweak.v64[1]);
+    for (u64 i = 0; i < count; i++) {
+        out[i].v64[0] = le64(lo);
+        out[i].v64[1] = le64(hi);
+        u64 carry = (0 - (hi >> 63)) & 0x87;
+        hi = (hi << 1) | (lo >> 63);
+        lo = (lo << 1) ^ carry;
+    }
+    tweak.v64[0] = le64(lo);
+    tweak.v64[1] = le64(hi);
+}
+
+class Tweak : public bigint128 {
+public:
+    inline Tweak() {}
+    inline Tweak(const bigint128& encrypted) : bigint128(encrypted) {}
+    //moves count blocks ahead, that is multiplying by alpha^count in one go instead of count updates.
+    //the bits shifted out at the top get folded back in as bits * (x^7 + x^2 + x + 1), which
+    //fits in 71 bits, so up to 64 doublings at a time need no more than one reduction
+    inline void Skip(u64 count) {
+        u64 lo = le64(v64[0]);
+        u64 hi = le64(v64[1]);
+        for (; count >= 64; count -= 64) {
+            u64 out = hi;
+            hi = lo ^ (out >> 63) ^ (out >> 62) ^ (out >> 57);
+            lo = out ^ (out << 1) ^ (out << 2) ^ (out << 7);
+        }
+        if (count) {
+            u64 out = hi >> (64 - count);
+            hi = (hi << count) | (lo >> (64 - count));
+            hi ^= (out >> 62) ^ (out >> 57);
+            lo = (lo << count) ^ out ^ (out << 1) ^ (out << 2) ^ (out << 7);
+        }
+        v64[0] = le64(lo);
+        v64[1] = le64(hi);
+    }
+    inline void Fill(bigint128* out, u64 count) {
+        fill_tweaks(*this, out, count);
+    }
+};
+
+//encrypted tweaks of the sectors runs recently started in, so repeated random reads
+//into the same sectors skip the tweak aes. it's small enough that a scan beats a map
+class TweakCache {
+    static const int size = 32;
+    struct Entry {
+        bigint128 sector;
+        bigint128 tweak;
+        u64 used; //0 means empty
+    } entries[size];
+    u64 clock;
+    std::mutex lock;
+public:
+    bool Get(const SectorOffset& sector, bigint128& tweak) {
+        std::lock_guard<std::mutex> l(lock);
+        for (int i = 0; i < size; i++) {
+            Entry& e = entries[i];
+            if(e.used && e.sector.v64[0] == sector.v64[0] && e.sector.v64[1] == sector.v64[1]) {
+                e.used = ++clock;
+                tweak = e.tweak;
+                return true;
+            }
+        }
+        return false;
+    }
+    void Put(const SectorOffset& sector, const bigint128& tweak) {
+        std::lock_guard<std::mutex> l(lock);
+        Entry* oldest = &entries[0];
+        for (int i = 1; i < size && oldest->used; i++) {
+            if(entries[i].used < oldest->used) oldest = &entries[i];
+        }
+        oldest->sector = sector;
+        oldest->tweak = tweak;
+        oldest->used = ++clock;
+    }
+    void Clear() {
+        std::lock_guard<std::mutex> l(lock);
+        memset(entries, 0, sizeof(entries));
+    }
+    TweakCache() : clock(0) {
+        memset(entries, 0, sizeof(entries));
+    }
+};
+
+class Buffer {
+public:
+    bigint128* ptr;
+    u64 len;
+    //when set, the input is read from here instead of ptr. it's copied over a batch at a time,
+    //so it's still in cache when it's crypted and a slow source (like a file mapping) is only touched once
+    const bigint128* src;
+    //crypt the next count blocks with their tweaks, then step past them
+    template<bool (*crypher)(const u8*, u8*, const bigint128*, u64)>
+    inline void Crypt(const u8* roundkeys, const bigint128* tweaks, u64 count) {
+        if(src) {
+            memcpy(ptr, src, count * 16LLU);
+            src += count;
+        }
+        if(!crypher(roundkeys, ptr->v8, tweaks, count)) throw false;
+        ptr += count;
+        len -= count * 16LLU;
+    }
+    Buffer() : ptr(NULL), len(0), src(NULL) {}
+};
+
+inline static void xor_blocks(u8* data, const bigint128* tweaks, u64 blocks) {
+    bigint128* d = (bigint128*)data;
+    for (u64 i = 0; i < blocks; i++) {
+        d[i].v64[0] ^= tweaks[i].v64[0];
+        d[i].v64[1] ^= tweaks[i].v64[1];
+    }
+}
+
+//for ciphers that only do plain blocks, the tweaks go around them in separate passes
+template<bool (*ecb)(const u8*, u8*, u64)>
+static bool xex_blocks(const u8* roundkeys, u8* data, const bigint128* tweaks, u64 blocks) {
+    xor_blocks(data, tweaks, blocks);
+    if(!ecb(roundkeys, data, blocks)) return false;
+    xor_blocks(data, tweaks, blocks);
+    return true;
+}
+
+//a one block cipher run over many blocks in place, for the tweaks of backends that only do one at a time
+template<bool (*crypt)(const u8*, const u8*, u8*)>
+static bool each_block(const u8* roundkeys, u8* data, u64 blocks) {
+    for (u64 i = 0; i < blocks; i++) {
+        if(!crypt(roundkeys, data + i * 16, data + i * 16)) return false;
+    }
+    return true;
+}
+
+static void *(WINAPI *EVP_CIPHER_CTX_new)() = NULL;
+static void *(WINAPI *EVP_aes_128_ecb)() = NULL;
+static int (WINAPI *EVP_CipherInit_ex)(void*, void*, void*, const void*, void*, int) = NULL;
+static int (WINAPI *EVP_CIPHER_CTX_key_length)(void*) = NULL;
+static void (WINAPI *EVP_CIPHER_CTX_set_padding)(void*, int) = NULL;
+static int (WINAPI *EVP_CipherUpdate)(void*, void*, int*, const void*, int) = NULL;
+static int (WINAPI *EVP_CipherFinal_ex)(void*, void*, int*) = NULL;
+static void (WINAPI *EVP_CIPHER_CTX_free)(void*) = NULL;
+static unsigned long (WINAPI *OpenSSL_version_num)() = NULL;
+
+static DynamicHelper lcrypto;
+static bool lib_to_load = true;
+static bool use_constant_time = false;
+
+struct Backend;
+
+//decrypt, encrypt and tweak contexts. a context can't be used by two threads at once, so every run takes a set
+struct OpenSSLKeys {
+    void *ctx[3];
+};
+
+struct xtsn_ctx {
+    u8 roundkeys_x2[352];
+    u8 roundkeys_dec[176]; //equivalent inverse cipher keys, for the t-tables and aes-ni
+    u64 roundkeys_ct[2][AES_CT_ROUNDKEY_WORDS]; //roundkeys_x2 bitsliced, for the constant-time backend
+    std::vector<OpenSSLKeys*> openssl_idle; //sets no run is using, only made when openssl is used
+    std::mutex lock; //guards openssl_idle
+    TweakCache tweak_cache;
+    std::atomic<const Backend*> backend; //NULL for the global one
+    xtsn_ctx() : backend(NULL) {}
+};
+
+//contexts are made once per key and direction, and live as long as the xtsn_ctx
+static void *openssl_ctx_new(const u8* key, bool encrypt) {
+    void *ctx = EVP_CIPHER_CTX_new();
+    if(!ctx) return NULL;
+    do {
+        if(!EVP_CipherInit_ex(ctx, EVP_aes_128_ecb(), NULL, key, NULL, (int)encrypt)) break;
+        if(EVP_CIPHER_CTX_key_length(ctx) != 16) break;
+        EVP_CIPHER_CTX_set_padding(ctx, 0);
+        return ctx;
+    } while(0);
+    EVP_CIPHER_CTX_free(ctx);
+    return NULL;
+}
+
+static void openssl_keys_free(OpenSSLKeys *keys) {
+    for (int i = 0; i < 3; i++) {
+        //after the lib is unloaded the contexts can only be leaked
+        if(keys->ctx[i] && lcrypto.HasHandle()) EVP_CIPHER_CTX_free(keys->ctx[i]);
+    }
+    delete keys;
+}
+
+static void openssl_ctx_free(xtsn_ctx *self) {
+    for (OpenSSLKeys *keys : self->openssl_idle) openssl_keys_free(keys);
+    self->openssl_idle.clear();
+}
+
+//a set for one run, made from the first round keys (the keys themselves) when none are idle. there end up
+//being as many as there were runs at once, usually the thread count
+static void *openssl_take(xtsn_ctx *self) {
+    {
+        std::lock_guard<std::mutex> l(self->lock);
+        if(!self->openssl_idle.empty()) {
+            OpenSSLKeys *keys = self->openssl_idle.back();
+            self->openssl_idle.pop_back();
+            return keys;
+        }
+    }
+    if(!lcrypto.HasHandle()) return NULL;
+    OpenSSLKeys *keys = new (std::nothrow) OpenSSLKeys();
+    if(!keys) return NULL;
+    keys->ctx[0] = openssl_ctx_new(self->roundkeys_x2, false);
+    keys->ctx[1] = openssl_ctx_new(self->roundkeys_x2, true);
+    keys->ctx[2] = openssl_ctx_new(self->roundkeys_x2 + 0xB0, true);
+    if(!keys->ctx[0] || !keys->ctx[1] || !keys->ctx[2]) {
+        openssl_keys_free(keys);
+        return NULL;
+    }
+    return keys;
+}
+
+static void openssl_give(xtsn_ctx *self, void *keys) {
+    std::lock_guard<std::mutex> l(self->lock);
+    self->openssl_idle.push_back((OpenSSLKeys*)keys);
+}
+
+static bool openssl_ecb(const u8* ctx, const u8* data, u8* out, int len) {
+    int foo;
+    return EVP_CipherUpdate((void*)ctx, out, &foo, data, len) && foo == len;
+}
+
+static bool openssl_crypt_blocks(const u8* ctx, u8* data, u64 blocks) {
+    return openssl_ecb(ctx, data, data, (int)(blocks * 16LLU));
+}
+
+static bool aes_encrypt_128_wrap(const u8* roundkey, const u8* data, u8* out) {
+    aes_ttable_encrypt_128(roundkey, data, out);
+    return true;
+}
+
+static bool aes_xts_decrypt_128_blocks_wrap(const u8* roundkey, u8* data, const bigint128* tweaks, u64 blocks) {
+    aes_ttable_xts_decrypt_128_blocks(roundkey, data, tweaks->v8, (size_t)blocks);
+    return true;
+}
+
+static bool aes_xts_encrypt_128_blocks_wrap(const u8* roundkey, u8* data, const bigint128* tweaks, u64 blocks) {
+    aes_ttable_xts_encrypt_128_blocks(roundkey, data, tweaks->v8, (size_t)blocks);
+    return true;
+}
+
+//bitsliced, for when timing through the cache matters more than speed. the tweaks go through
+//it too, both directions use the encryption round keys, and the keys are the packed roundkeys_ct
+static bool aes_ct_encrypt_128_blocks_wrap(const u8* roundkey, u8* data, u64 blocks) {
+    aes_ct_encrypt_128_blocks((const uint64_t*)roundkey, data, (size_t)blocks);
+    return true;
+}
+
+static bool aes_ct_xts_decrypt_128_blocks_wrap(const u8* roundkey, u8* data, const bigint128* tweaks, u64 blocks) {
+    aes_ct_xts_decrypt_128_blocks((const uint64_t*)roundkey, data, tweaks->v8, (size_t)blocks);
+    return true;
+}
+
+static bool aes_ct_xts_encrypt_128_blocks_wrap(const u8* roundkey, u8* data, const bigint128* tweaks, u64 blocks) {
+    aes_ct_xts_encrypt_128_blocks((const uint64_t*)roundkey, data, tweaks->v8, (size_t)blocks);
+    return true;
+}
+
+#ifdef AESNI_BUILD
+static bool aesni_encrypt_128_wrap(const u8* roundkey, const u8* data, u8* out) {
+    aesni_encrypt_128(roundkey, data, out);
+    return true;
+}
+
+static bool aesni_xts_decrypt_128_blocks_wrap(const u8* roundkey, u8* data, const bigint128* tweaks, u64 blocks) {
+    aesni_xts_decrypt_128_blocks(roundkey, data, tweaks->v8, (size_t)blocks);
+    return true;
+}
+
+static bool aesni_xts_encrypt_128_blocks_wrap(const u8* roundkey, u8* data, const bigint128* tweaks, u64 blocks) {
+    aesni_xts_encrypt_128_blocks(roundkey, data, tweaks->v8, (size_t)blocks);
+    return true;
+}
+#endif
+
+#ifdef ARMV8_AES_BUILD
+static bool armv8_encrypt_128_wrap(const u8* roundkey, const u8* data, u8* out) {
+    armv8_encrypt_128(roundkey, data, out);
+    return true;
+}
+
+static bool armv8_xts_decrypt_128_blocks_wrap(const u8* roundkey, u8* data, const bigint128* tweaks, u64 blocks) {
+    armv8_xts_decrypt_128_blocks(roundkey, data, tweaks->v8, (size_t)blocks);
+    return true;
+}
+
+static bool armv8_xts_encrypt_128_blocks_wrap(const u8* roundkey, u8* data, const bigint128* tweaks, u64 blocks) {
+    armv8_xts_encrypt_128_blocks(roundkey, data, tweaks->v8, (size_t)blocks);
+    return true;
+}
+#endif
+
+#ifdef VAES_BUILD
+static bool vaes_xts_decrypt_128_blocks_wrap(const u8* roundkey, u8* data, const bigint128* tweaks, u64 blocks) {
+    vaes_xts_decrypt_128_blocks(roundkey, data, tweaks->v8, (size_t)blocks);
+    return true;
+}
+
+static bool vaes_xts_encrypt_128_blocks_wrap(const u8* roundkey, u8* data, const bigint128* tweaks, u64 blocks) {
+    vaes_xts_encrypt_128_blocks(roundkey, data, tweaks->v8, (size_t)blocks);
+    return true;
+}
+
+static void vaes_xts_tweaks_wrap(bigint128& tweak, bigint128* out, u64 count) {
+    vaes_xts_tweaks(tweak.v8, out->v8, (size_t)count);
+}
+#endif
+
+//workers that big buffers are split between. they are started when first needed and then
+//live until the process exits, so nothing has to join them at interpreter shutdown
+class WorkerPool {
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<std::function<void()>> queue;
+    size_t workers;
+    void Work() {
+        for(;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> l(lock);
+                wake.wait(l, [this] {return !queue.empty();});
+                task = std::move(queue.front());
+                queue.pop_front();
+            }
+            task();
+        }
+    }
+public:
+    //runs every task and returns once all are done, the calling thread does the first one itself
+    void RunAll(std::vector<std::function<void()>>& tasks) {
+        std::mutex done_lock;
+        std::condition_variable done;
+        size_t left = tasks.size() - 1;
+        {
+            std::lock_guard<std::mutex> l(lock);
+            try {
+                while(workers < tasks.size() - 1) {
+                    std::thread(&WorkerPool::Work, this).detach();
+                    workers++;
+                }
+            } catch(const std::system_error&) {
+                //no threads to be had, do it all here
+                if(!workers) {
+                    for (auto& task : tasks) task();
+                    return;
+                }
+            }
+            for (size_t i = 1; i < tasks.size(); i++) {
+                queue.push_back([&, i] {
+                    tasks[i]();
+                    std::lock_guard<std::mutex> d(done_lock);
+                    if(!--left) done.notify_one();
+                });
+            }
+        }
+        wake.notify_all();
+        tasks[0]();
+        std::unique_lock<std::mutex> d(done_lock);
+        done.wait(d, [&] {return left == 0;});
+    }
+    WorkerPool() : workers(0) {}
+};
+
+//made on first use and never freed, see above
+static WorkerPool& worker_pool() {
+    static WorkerPool *pool = new WorkerPool();
+    return *pool;
+}
+
+//counters for xtsn_get_stats, the totals first and then a set for each backend
+enum {
+    STAT_TWEAK_AES,
+    STAT_TWEAK_CACHE_HITS,
+    STAT_SEEK_BLOCKS,
+    STAT_RUNS,
+    STAT_RUN_NS,
+    STAT_SPLIT_CALLS,
+    STAT_ERRORS,
+    STAT_BACKENDS,
+};
+enum {
+    STAT_DECRYPT_CALLS,
+    STAT_DECRYPT_BYTES,
+    STAT_ENCRYPT_CALLS,
+    STAT_ENCRYPT_BYTES,
+    STAT_NS,
+    STAT_PER_BACKEND,
+};
+#define STAT_MAX_BACKENDS 8
+#define STAT_COUNT (STAT_BACKENDS + STAT_MAX_BACKENDS * STAT_PER_BACKEND)
+
+//every thread counts into a set of its own with plain loads and stores, which costs next to
+//nothing next to atomic adds on shared counters. reading them adds up all the sets
+class StatsRegistry {
+public:
+    class Set {
+        std::atomic<u64> v[STAT_COUNT];
+        friend class StatsRegistry;
+    public:
+        //only the owning thread writes, so this doesn't need to be atomic as a whole
+        inline void Add(int stat, u64 amount) {
+            v[stat].store(v[stat].load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+        }
+        Set();
+        ~Set();
+    };
+private:
+    std::mutex lock;
+    std::vector<Set*> sets;
+    u64 retired[STAT_COUNT]; //from threads that exited
+    u64 baseline[STAT_COUNT]; //the totals at the last reset
+    void Sum(u64 *out) {
+        memcpy(out, retired, sizeof(retired));
+        for (Set* set : sets) {
+            for (int i = 0; i < STAT_COUNT; i++) out[i] += set->v[i].load(std::memory_order_relaxed);
+        }
+    }
+public:
+    //the counts since the last reset. the sets only ever grow, so a reset is remembering where they were
+    void Get(u64 *out) {
+        std::lock_guard<std::mutex> l(lock);
+        Sum(out);
+        for (int i = 0; i < STAT_COUNT; i++) out[i] -= baseline[i];
+    }
+    void Reset() {
+        std::lock_guard<std::mutex> l(lock);
+        Sum(baseline);
+    }
+    StatsRegistry() {
+        memset(retired, 0, sizeof(retired));
+        memset(baseline, 0, sizeof(baseline));
+    }
+};
+
+//made on first use and never freed, so threads exiting late can still hand in their counts
+static StatsRegistry& stats_registry() {
+    static StatsRegistry *registry = new StatsRegistry();
+    return *registry;
+}
+
+StatsRegistry::Set::Set() {
+    for (std::atomic<u64>& c : v) c.store(0, std::memory_order_relaxed);
+    StatsRegistry& r = stats_registry();
+    std::lock_guard<std::mutex> l(r.lock);
+    r.sets.push_back(this);
+}
+
+StatsRegistry::Set::~Set() {
+    StatsRegistry& r = stats_registry();
+    std::lock_guard<std::mutex> l(r.lock);
+    for (int i = 0; i < STAT_COUNT; i++) r.retired[i] += v[i].load(std::memory_order_relaxed);
+    for (size_t i = 0; i < r.sets.size(); i++) {
+        if(r.sets[i] == this) {
+            r.sets.erase(r.sets.begin() + i);
+            break;
+        }
+    }
+}
+
+static thread_local StatsRegistry::Set thread_stats;
+
+inline static u64 elapsed_ns(std::chrono::steady_clock::time_point start) {
+    return (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+//what one Run did, kept locally and added to the counters once it's over, however it ends.
+//the time is taken around it by RunParallel, which needs it anyway
+struct RunCounters {
+    u64 tweak_aes;
+    u64 tweak_cache_hits;
+    u64 seek_blocks;
+    RunCounters() : tweak_aes(0), tweak_cache_hits(0), seek_blocks(0) {}
+    ~RunCounters() {
+        StatsRegistry::Set& stats = thread_stats;
+        stats.Add(STAT_TWEAK_AES, tweak_aes);
+        stats.Add(STAT_TWEAK_CACHE_HITS, tweak_cache_hits);
+        stats.Add(STAT_SEEK_BLOCKS, seek_blocks);
+        stats.Add(STAT_RUNS, 1);
+    }
+};
+
+//what calls passing 0 threads use. set from any thread while others read it
+static std::atomic<int> default_threads(1);
+//parts smaller than this aren't worth handing to another thread
+#define XTSN_THREAD_MIN_BYTES 0x40000LLU
+
+//where each backend finds the keys for crypher and crypher2, on the object or what the run took
+inline static const u8* key_roundkeys(xtsn_ctx *self, void *taken) {return self->roundkeys_x2;}
+inline static const u8* key_roundkeys_tweak(xtsn_ctx *self, void *taken) {return self->roundkeys_x2 + 0xB0;}
+inline static const u8* key_roundkeys_dec(xtsn_ctx *self, void *taken) {return self->roundkeys_dec;}
+inline static const u8* key_roundkeys_ct(xtsn_ctx *self, void *taken) {return (const u8*)self->roundkeys_ct[0];}
+inline static const u8* key_roundkeys_ct_tweak(xtsn_ctx *self, void *taken) {return (const u8*)self->roundkeys_ct[1];}
+//openssl gets its context through the key pointer
+template<int idx>
+inline static const u8* key_openssl_ctx(xtsn_ctx *self, void *taken) {return (const u8*)((OpenSSLKeys*)taken)->ctx[idx];}
+//the round keys are made with the object and can be shared, so most backends have nothing to take
+inline static void *keys_shared(xtsn_ctx *self) {return self;}
+inline static void keys_shared_give(xtsn_ctx *self, void *taken) {}
+
+//blocks that go through the data crypher in one call; a page worth of tweaks stays in L1
+#define XTSN_BATCH_BLOCKS 256
+//per call overhead is large for openssl, so it gets a whole 0x4000 nand sector at once
+#define XTSN_OPENSSL_BATCH_BLOCKS 1024
+//sector tweaks encrypted per crypher2 call, as many as the bitsliced cipher does in one go
+#define XTSN_TWEAKS_AHEAD 8
+
+//crypher does many blocks with their tweaks in place per call, crypher2 encrypts the tweaks of several sectors
+//in place
+//fill: lays out the tweaks for a batch from the current one
+//take/give: keys that can't be used from two threads at once, each run (and each part of a split one)
+//takes its own for as long as it runs, NULL if they can't be made
+template<bool (*crypher)(const u8*, u8*, const bigint128*, u64), bool (*crypher2)(const u8*, u8*, u64),
+         const u8* (*key)(xtsn_ctx*, void*), const u8* (*key2)(xtsn_ctx*, void*), u64 batch = XTSN_BATCH_BLOCKS,
+         void (*fill)(bigint128&, bigint128*, u64) = &fill_tweaks, void *(*take)(xtsn_ctx*) = &keys_shared,
+         void (*give)(xtsn_ctx*, void*) = &keys_shared_give>
+class XTSN {
+    SectorOffset sectoroffset;
+    Buffer buf;
+    u64 sector_size;
+    u64 skipped_bytes;
+    xtsn_ctx *ctx;
+    const u8 *roundkeys_key;
+    const u8 *roundkeys_tweak;
+    TweakCache *tweak_cache;
+    //gives back what a run took, also when it throws
+    struct Taken {
+        xtsn_ctx *ctx;
+        void *keys;
+        Taken(xtsn_ctx *ctx) : ctx(ctx), keys(take(ctx)) {}
+        ~Taken() {if(keys) give(ctx, keys);}
+    };
+    #ifdef DEBUGON
+    void Debug() { //debug printing.
+        printf("Sector Offset (Lo, Hi): %llu, %llu\n"
+            "Buffer Length: %llu\n"
+            "Sector Size: %llu\n"
+            "Skipped Bytes: %llu\n\n",
+            (unsigned long long)*sectoroffset.Lo(), (unsigned long long)*sectoroffset.Hi(),
+            (unsigned long long)buf.len,
+            (unsigned long long)sector_size,
+            (unsigned long long)skipped_bytes);
+        fflush(stdout);
+    }
+    #endif
+    //encrypts the tweaks of the next sectors sectors from sectoroffset on into ahead, up to XTSN_TWEAKS_AHEAD
+    //of them, and returns how many. the sectors all start in the buffer, so none are done for nothing
+    u64 EncryptTweaks(bigint128* ahead, u64 sectors) {
+        SectorOffset sector = sectoroffset;
+        if(sectors > XTSN_TWEAKS_AHEAD) sectors = XTSN_TWEAKS_AHEAD;
+        for (u64 i = 0; i < sectors; i++, sector.Step()) {
+            ahead[i].v64[1] = be64(sector.v64[0]);
+            ahead[i].v64[0] = be64(sector.v64[1]);
+        }
+        if(!crypher2(roundkeys_tweak, ahead->v8, sectors)) throw false;
+        return sectors;
+    }
+    //tweaks are laid out for a batch first (crossing sectors as needed),
+    //so the crypher gets independent blocks it can keep in flight together
+    void Run() {
+        bigint128 tweaks[batch];
+        bigint128 ahead[XTSN_TWEAKS_AHEAD];
+        u64 ahead_used = 0, ahead_count = 0;
+        Taken taken(ctx);
+        if(!taken.keys) throw false;
+        roundkeys_key = key(ctx, taken.keys);
+        roundkeys_tweak = key2(ctx, taken.keys);
+        RunCounters stats;
+        u64 sector_blocks = sector_size / 16LLU;
+        u64 block = 0;
+        if(skipped_bytes) {
+            if(skipped_bytes / sector_size) {
+                sectoroffset.Step(skipped_bytes / sector_size);
+                skipped_bytes %= sector_size;
+            }
+            block = skipped_bytes / 16LLU;
+        }
+        Tweak tweak;
+        if(!tweak_cache || !tweak_cache->Get(sectoroffset, tweak)) {
+            ahead_count = EncryptTweaks(ahead, (block + buf.len / 16LLU + sector_blocks - 1) / sector_blocks);
+            stats.tweak_aes += ahead_count;
+            tweak = ahead[ahead_used++];
+            if(tweak_cache) tweak_cache->Put(sectoroffset, tweak);
+        } else {
+            stats.tweak_cache_hits++;
+        }
+        tweak.Skip(block);
+        stats.seek_blocks = block;
+        while(buf.len) {
+            u64 blocks = buf.len / 16LLU;
+            u64 count = 0;
+            while(count < batch && count < blocks) {
+                if(block == sector_blocks) {
+                    sectoroffset.Step();
+                    if(ahead_used == ahead_count) {
+                        ahead_count = EncryptTweaks(ahead, (blocks - count + sector_blocks - 1) / sector_blocks);
+                        ahead_used = 0;
+                        stats.tweak_aes += ahead_count;
+                    }
+                    tweak = ahead[ahead_used++];
+                    block = 0;
+                }
+                u64 n = batch - count;
+                if(n > blocks - count) n = blocks - count;
+                if(n > sector_blocks - block) n = sector_blocks - block;
+                fill(tweak, tweaks + count, n);
+                count += n;
+                block += n;
+            }
+            buf.Crypt<crypher>(roundkeys_key, tweaks, count);
+        }
+    }
+    //sectors don't depend on each other, so the buffer is split on sector boundaries
+    //into up to threads parts, each one being a Run of its own. no python calls allowed here.
+    //ns gets the wall time it took
+    bool RunParallel(int threads, u64& ns) {
+        std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+        bool failed = false;
+        if(skipped_bytes / sector_size) {
+            sectoroffset.Step(skipped_bytes / sector_size);
+            skipped_bytes %= sector_size;
+        }
+        u64 sectors = (skipped_bytes + buf.len + sector_size - 1) / sector_size;
+        u64 part_sectors = (sectors + threads - 1) / threads;
+        if(part_sectors * sector_size < XTSN_THREAD_MIN_BYTES)
+            part_sectors = (XTSN_THREAD_MIN_BYTES + sector_size - 1) / sector_size;
+        if(threads < 2 || part_sectors >= sectors) {
+            try {
+                Run();
+            } catch(...) {
+                failed = true;
+            }
+            ns = elapsed_ns(start_time);
+            thread_stats.Add(STAT_RUN_NS, ns);
+            return !failed;
+        }
+
+        std::mutex failed_lock;
+        std::vector<std::function<void()>> tasks;
+        for (u64 first = 0; first < sectors; first += part_sectors) {
+            XTSN part = *this;
+            u64 start = first ? first * sector_size - skipped_bytes : 0;
+            u64 end = (first + part_sectors) * sector_size - skipped_bytes;
+            if(end > buf.len) end = buf.len;
+            part.buf.ptr = buf.ptr + start / 16LLU;
+            part.buf.len = end - start;
+            if(buf.src) part.buf.src = buf.src + start / 16LLU;
+            if(first) {
+                part.sectoroffset.Step(first);
+                part.skipped_bytes = 0;
+            }
+            tasks.push_back([part, &failed, &failed_lock]() mutable {
+                std::chrono::steady_clock::time_point part_start = std::chrono::steady_clock::now();
+                try {
+                    part.Run();
+                } catch(...) {
+                    std::lock_guard<std::mutex> l(failed_lock);
+                    failed = true;
+                }
+                thread_stats.Add(STAT_RUN_NS, elapsed_ns(part_start));
+            });
+        }
+        thread_stats.Add(STAT_SPLIT_CALLS, 1);
+        worker_pool().RunAll(tasks);
+        ns = elapsed_ns(start_time);
+        return !failed;
+    }
+public:
+    //crypts len bytes from in into out, or out in place when in is NULL. ns gets the time spent crypting
+    static int Go(xtsn_ctx *ctx, void *out, const void *in, u64 len, u64 sector_lo, u64 sector_hi,
+                  u64 sector_size, u64 skipped_bytes, int threads, u64& ns) {
+        XTSN xtsn;
+        if (!len)
+            return XTSN_OK;
+        if (len % 16)
+            return XTSN_ERR_LENGTH;
+        if (skipped_bytes % 16)
+            return XTSN_ERR_SKIPPED;
+        if (sector_size == 0)
+            return XTSN_ERR_SECTOR_SIZE_ZERO;
+        if (sector_size % 16)
+            return XTSN_ERR_SECTOR_SIZE;
+        if (threads < 0)
+            return XTSN_ERR_THREADS;
+
+        if (threads == 0) threads = default_threads;
+
+        //copying along the way only works when they don't overlap, which is the usual case
+        if (in == out) {
+            in = NULL;
+        } else if (in && !((const u8 *)out + len <= (const u8 *)in || (const u8 *)in + len <= (const u8 *)out)) {
+            memmove(out, in, len);
+            in = NULL;
+        }
+
+        *xtsn.sectoroffset.Lo() = sector_lo;
+        *xtsn.sectoroffset.Hi() = sector_hi;
+        xtsn.sector_size = sector_size;
+        xtsn.skipped_bytes = skipped_bytes;
+        xtsn.ctx = ctx;
+        xtsn.tweak_cache = &ctx->tweak_cache;
+        xtsn.buf.ptr = (bigint128 *) out;
+        xtsn.buf.len = len;
+        xtsn.buf.src = (const bigint128 *) in;
+
+        #ifdef DEBUGON
+        xtsn.Debug();
+        #endif
+        return xtsn.RunParallel(threads, ns) ? XTSN_OK : XTSN_ERR_BACKEND;
+    }
+    inline XTSN() : sector_size(0x200), skipped_bytes(0), ctx(NULL), tweak_cache(NULL) {}
+};
+
+typedef XTSN<&aes_xts_decrypt_128_blocks_wrap, &each_block<&aes_encrypt_128_wrap>,
+             &key_roundkeys_dec, &key_roundkeys_tweak> XTSNDecrypt;
+typedef XTSN<&aes_xts_encrypt_128_blocks_wrap, &each_block<&aes_encrypt_128_wrap>,
+             &key_roundkeys, &key_roundkeys_tweak> XTSNEncrypt;
+typedef XTSN<&aes_ct_xts_decrypt_128_blocks_wrap, &aes_ct_encrypt_128_blocks_wrap,
+             &key_roundkeys_ct, &key_roundkeys_ct_tweak> XTSNCTDecrypt;
+typedef XTSN<&aes_ct_xts_encrypt_128_blocks_wrap, &aes_ct_encrypt_128_blocks_wrap,
+             &key_roundkeys_ct, &key_roundkeys_ct_tweak> XTSNCTEncrypt;
+typedef XTSN<&xex_blocks<openssl_crypt_blocks>, &openssl_crypt_blocks, &key_openssl_ctx<0>, &key_openssl_ctx<2>,
+             XTSN_OPENSSL_BATCH_BLOCKS, &fill_tweaks, &openssl_take, &openssl_give> XTSNOpenSSLDecrypt;
+typedef XTSN<&xex_blocks<openssl_crypt_blocks>, &openssl_crypt_blocks, &key_openssl_ctx<1>, &key_openssl_ctx<2>,
+             XTSN_OPENSSL_BATCH_BLOCKS, &fill_tweaks, &openssl_take, &openssl_give> XTSNOpenSSLEncrypt;
+#ifdef AESNI_BUILD
+typedef XTSN<&aesni_xts_decrypt_128_blocks_wrap, &each_block<&aesni_encrypt_128_wrap>,
+             &key_roundkeys_dec, &key_roundkeys_tweak> XTSNAESNIDecrypt;
+typedef XTSN<&aesni_xts_encrypt_128_blocks_wrap, &each_block<&aesni_encrypt_128_wrap>,
+             &key_roundkeys, &key_roundkeys_tweak> XTSNAESNIEncrypt;
+#endif
+#ifdef ARMV8_AES_BUILD
+typedef XTSN<&armv8_xts_decrypt_128_blocks_wrap, &each_block<&armv8_encrypt_128_wrap>,
+             &key_roundkeys_dec, &key_roundkeys_tweak> XTSNARMv8Decrypt;
+typedef XTSN<&armv8_xts_encrypt_128_blocks_wrap, &each_block<&armv8_encrypt_128_wrap>,
+             &key_roundkeys, &key_roundkeys_tweak> XTSNARMv8Encrypt;
+#endif
+#ifdef VAES_BUILD
+typedef XTSN<&vaes_xts_decrypt_128_blocks_wrap, &each_block<&aesni_encrypt_128_wrap>,
+             &key_roundkeys_dec, &key_roundkeys_tweak, XTSN_BATCH_BLOCKS, &vaes_xts_tweaks_wrap> XTSNVAESDecrypt;
+typedef XTSN<&vaes_xts_encrypt_128_blocks_wrap, &each_block<&aesni_encrypt_128_wrap>,
+             &key_roundkeys, &key_roundkeys_tweak, XTSN_BATCH_BLOCKS, &vaes_xts_tweaks_wrap> XTSNVAESEncrypt;
+#endif
+
+//the bitsliced schedule for every backend, so no key byte ever picks a table entry. the aes instruction
+//backends are only constant time with it
+inline static void
+aes_xtsn_schedule_128(const u8* key, const u8* tweakin, u8* roundkeys_x2) {
+    aes_ct_key_schedule_128(key, roundkeys_x2);
+    aes_ct_key_schedule_128(tweakin, roundkeys_x2 + 0xB0);
+}
+
+static void load_lcrypto() {
+    if(!lib_to_load) return;
+    lib_to_load = false;
+    if(!lcrypto.LoadLib(LIBCRYPTO)) return;
+    lcrypto.GetFunctionPtr("EVP_CIPHER_CTX_new", (void**)&EVP_CIPHER_CTX_new);
+    lcrypto.GetFunctionPtr("EVP_aes_128_ecb", (void**)&EVP_aes_128_ecb);
+    lcrypto.GetFunctionPtr("EVP_CipherInit_ex", (void**)&EVP_CipherInit_ex);
+    lcrypto.GetFunctionPtr("EVP_CIPHER_CTX_key_length", (void**)&EVP_CIPHER_CTX_key_length);
+    //3.0 renamed it, the old name is only a macro there
+    if(!EVP_CIPHER_CTX_key_length)
+        lcrypto.GetFunctionPtr("EVP_CIPHER_CTX_get_key_length", (void**)&EVP_CIPHER_CTX_key_length);
+    lcrypto.GetFunctionPtr("EVP_CIPHER_CTX_set_padding", (void**)&EVP_CIPHER_CTX_set_padding);
+    lcrypto.GetFunctionPtr("EVP_CipherUpdate", (void**)&EVP_CipherUpdate);
+    lcrypto.GetFunctionPtr("EVP_CipherFinal_ex", (void**)&EVP_CipherFinal_ex);
+    lcrypto.GetFunctionPtr("EVP_CIPHER_CTX_free", (void**)&EVP_CIPHER_CTX_free);
+    lcrypto.GetFunctionPtr("OpenSSL_version_num", (void**)&OpenSSL_version_num);
+
+    if(!EVP_CIPHER_CTX_new || !EVP_aes_128_ecb || !EVP_CipherInit_ex ||
+      !EVP_CIPHER_CTX_key_length || !EVP_CIPHER_CTX_set_padding ||
+      !EVP_CipherUpdate || !EVP_CipherFinal_ex || !EVP_CIPHER_CTX_free ||
+      !OpenSSL_version_num) {
+        lcrypto.Unload();
+        return;
+    }
+
+    //check at bare minimum, 1.1, any variant
+    if(OpenSSL_version_num() < 0x10100000LU) {
+        lcrypto.Unload();
+        return;
+    }
+}
+
+typedef int (*xtsn_run)(xtsn_ctx*, void*, const void*, u64, u64, u64, u64, u64, int, u64&);
+
+struct Backend {
+    xtsn_backend_info info;
+    bool hardware; //aes instructions, preferred over everything else
+    bool (*supported)();
+    xtsn_run decrypt;
+    xtsn_run encrypt;
+};
+
+static bool always_supported() {return true;}
+static bool openssl_supported() {
+    load_lcrypto();
+    return lcrypto.HasHandle();
+}
+#ifdef AESNI_BUILD
+static bool aesni_backend_supported() {return aesni_supported() != 0;}
+#endif
+#ifdef VAES_BUILD
+static bool vaes_backend_supported() {return vaes_supported() != 0;}
+#endif
+#ifdef ARMV8_AES_BUILD
+static bool armv8_backend_supported() {return armv8_aes_supported() != 0;}
+#endif
+
+//fastest first. available is filled in when they're listed
+static const Backend backends[] = {
+    #ifdef VAES_BUILD
+    {{"vaes", "VAES, AVX-512F", 512, 16, XTSN_BATCH_BLOCKS, 1, 0}, true, &vaes_backend_supported,
+     &XTSNVAESDecrypt::Go, &XTSNVAESEncrypt::Go},
+    #endif
+    #ifdef AESNI_BUILD
+    {{"aes-ni", "AES-NI, SSE2", 128, 8, XTSN_BATCH_BLOCKS, 1, 0}, true, &aesni_backend_supported,
+     &XTSNAESNIDecrypt::Go, &XTSNAESNIEncrypt::Go},
+    #endif
+    #ifdef ARMV8_AES_BUILD
+    {{"armv8", "ARMv8 Crypto Extensions", 128, 8, XTSN_BATCH_BLOCKS, 1, 0}, true, &armv8_backend_supported,
+     &XTSNARMv8Decrypt::Go, &XTSNARMv8Encrypt::Go},
+    #endif
+    //whatever libcrypto does inside, it may well be table lookups
+    {{"openssl", "", 0, 0, XTSN_OPENSSL_BATCH_BLOCKS, 0, 0}, false, &openssl_supported,
+     &XTSNOpenSSLDecrypt::Go, &XTSNOpenSSLEncrypt::Go},
+    {{"constant-time", "", 64, 8, XTSN_BATCH_BLOCKS, 1, 0}, false, &always_supported,
+     &XTSNCTDecrypt::Go, &XTSNCTEncrypt::Go},
+    {{"portable", "", 0, 1, XTSN_BATCH_BLOCKS, 0, 0}, false, &always_supported,
+     &XTSNDecrypt::Go, &XTSNEncrypt::Go},
+};
+static const int backend_count = (int)(sizeof(backends) / sizeof(backends[0]));
+static const Backend *const portable_backend = &backends[backend_count - 1];
+static_assert(sizeof(backends) / sizeof(backends[0]) <= STAT_MAX_BACKENDS, "STAT_MAX_BACKENDS is too small");
+
+//what contexts without their own backend use. every call reads it once, so it can change at any time
+static std::atomic<const Backend*> global_backend(portable_backend);
+static bool initialized = false;
+static std::mutex init_lock;
+
+static const Backend *find_backend(const char *name) {
+    for (const Backend& b : backends) {
+        if(!strcmp(b.info.name, name)) return &b;
+    }
+    return NULL;
+}
+
+//aes instructions beat both the portable code and openssl, so when the cpu has them, openssl isn't
+//even loaded. vaes is the aes-ni instructions four blocks wide, and uses the same keys
+static const Backend *default_backend() {
+    for (const Backend& b : backends) {
+        if(b.hardware && b.supported()) return &b;
+    }
+    if(use_constant_time) return find_backend("constant-time");
+    if(openssl_supported()) return find_backend("openssl");
+    return portable_backend;
+}
+
+//finds a backend that can be used, for the set_backend functions
+static int lookup_backend(const char *name, const Backend **out) {
+    const Backend *b = find_backend(name);
+    if(!b) return XTSN_ERR_UNKNOWN_BACKEND;
+    if(!b->supported()) return XTSN_ERR_UNAVAILABLE;
+    *out = b;
+    return XTSN_OK;
+}
+
+inline static const Backend *ctx_backend(xtsn_ctx *ctx) {
+    const Backend *b = ctx->backend.load(std::memory_order_relaxed);
+    return b ? b : global_backend.load(std::memory_order_relaxed);
+}
+
+//the backend is read once, so the call and its counters agree even if it's changed meanwhile
+static int run_counted(xtsn_ctx *ctx, bool encrypt, void *out, const void *in, u64 len, u64 sector_lo,
+                       u64 sector_hi, u64 sector_size, u64 skipped_bytes, int threads) {
+    const Backend *b = ctx_backend(ctx);
+    int stat = STAT_BACKENDS + (int)(b - backends) * STAT_PER_BACKEND;
+    u64 ns = 0;
+    int err = (encrypt ? b->encrypt : b->decrypt)(ctx, out, in, len, sector_lo, sector_hi, sector_size,
+                                                    skipped_bytes, threads, ns);
+    StatsRegistry::Set& stats = thread_stats;
+    stats.Add(stat + STAT_NS, ns);
+    if(err) {
+        stats.Add(STAT_ERRORS, 1);
+        return err;
+    }
+    stats.Add(stat + (encrypt ? STAT_ENCRYPT_CALLS : STAT_DECRYPT_CALLS), 1);
+    stats.Add(stat + (encrypt ? STAT_ENCRYPT_BYTES : STAT_DECRYPT_BYTES), len);
+    return XTSN_OK;
+}
+
+extern "C" {
+
+void xtsn_init(void) {
+    std::lock_guard<std::mutex> l(init_lock);
+    if(initialized) return;
+    initialized = true;
+    global_backend = default_backend();
+}
+
+void xtsn_cleanup(void) {
+    std::lock_guard<std::mutex> l(init_lock);
+    global_backend = portable_backend;
+    lcrypto.Unload();
+    lib_to_load = true;
+    initialized = false;
+}
+
+int xtsn_backends(xtsn_backend_info *out, int max) {
+    std::lock_guard<std::mutex> l(init_lock);
+    for (int i = 0; i < backend_count && i < max; i++) {
+        out[i] = backends[i].info;
+        out[i].available = backends[i].supported();
+    }
+    return backend_count;
+}
+
+int xtsn_set_backend(const char *name) {
+    const Backend *b;
+    int err;
+    xtsn_init();
+    std::lock_guard<std::mutex> l(init_lock);
+    if(!name) {
+        global_backend = default_backend();
+        return XTSN_OK;
+    }
+    if((err = lookup_backend(name, &b))) return err;
+    global_backend = b;
+    return XTSN_OK;
+}
+
+const char *xtsn_backend(void) {
+    return global_backend.load()->info.name;
+}
+
+//the aes instructions don't look anything up, so this only changes what's used without them
+void xtsn_set_constant_time(int enable) {
+    xtsn_init();
+    std::lock_guard<std::mutex> l(init_lock);
+    use_constant_time = enable != 0;
+    global_backend = default_backend();
+}
+
+int xtsn_get_constant_time(void) {
+    return global_backend.load()->info.constant_time;
+}
+
+int xtsn_set_threads(int threads) {
+    if(threads < 1) return XTSN_ERR_THREADS;
+    default_threads = threads;
+    return XTSN_OK;
+}
+
+int xtsn_get_threads(void) {
+    return default_threads;
+}
+
+int xtsn_new(const uint8_t *key, const uint8_t *tweak, xtsn_ctx **ctx) {
+    xtsn_ctx *self;
+    xtsn_init();
+    *ctx = NULL;
+    if(!(self = new (std::nothrow) xtsn_ctx())) return XTSN_ERR_NOMEM;
+
+    aes_xtsn_schedule_128(key, tweak, self->roundkeys_x2);
+    aes_decrypt_key_schedule_128(self->roundkeys_x2, self->roundkeys_dec);
+    aes_ct_pack_roundkeys_128(self->roundkeys_x2, self->roundkeys_ct[0]);
+    aes_ct_pack_roundkeys_128(self->roundkeys_x2 + 0xB0, self->roundkeys_ct[1]);
+    *ctx = self;
+    return XTSN_OK;
+}
+
+int xtsn_ctx_set_backend(xtsn_ctx *ctx, const char *name) {
+    const Backend *b = NULL;
+    int err;
+    if(name) {
+        std::lock_guard<std::mutex> l(init_lock);
+        if((err = lookup_backend(name, &b))) return err;
+    }
+    ctx->backend = b;
+    return XTSN_OK;
+}
+
+const char *xtsn_ctx_backend(xtsn_ctx *ctx) {
+    return ctx_backend(ctx)->info.name;
+}
+
+void xtsn_free(xtsn_ctx *ctx) {
+    if(!ctx) return;
+    openssl_ctx_free(ctx);
+    delete ctx;
+}
+
+int xtsn_decrypt(xtsn_ctx *ctx, void *out, const void *in, size_t len, uint64_t sector_lo, uint64_t sector_hi,
+                 uint64_t sector_size, uint64_t skipped_bytes, int threads) {
+    return run_counted(ctx, false, out, in, len, sector_lo, sector_hi, sector_size, skipped_bytes, threads);
+}
+
+int xtsn_encrypt(xtsn_ctx *ctx, void *out, const void *in, size_t len, uint64_t sector_lo, uint64_t sector_hi,
+                 uint64_t sector_size, uint64_t skipped_bytes, int threads) {
+    return run_counted(ctx, true, out, in, len, sector_lo, sector_hi, sector_size, skipped_bytes, threads);
+}
+
+int xtsn_get_stats(xtsn_stats *stats, xtsn_backend_stats *backends, int max) {
+    u64 v[STAT_COUNT];
+    stats_registry().Get(v);
+    if(stats) {
+        stats->tweak_aes = v[STAT_TWEAK_AES];
+        stats->tweak_cache_hits = v[STAT_TWEAK_CACHE_HITS];
+        stats->seek_blocks = v[STAT_SEEK_BLOCKS];
+        stats->runs = v[STAT_RUNS];
+        stats->run_ns = v[STAT_RUN_NS];
+        stats->split_calls = v[STAT_SPLIT_CALLS];
+        stats->errors = v[STAT_ERRORS];
+    }
+    for (int i = 0; i < backend_count && i < max; i++) {
+        const u64 *b = v + STAT_BACKENDS + i * STAT_PER_BACKEND;
+        backends[i].decrypt_calls = b[STAT_DECRYPT_CALLS];
+        backends[i].decrypt_bytes = b[STAT_DECRYPT_BYTES];
+        backends[i].encrypt_calls = b[STAT_ENCRYPT_CALLS];
+        backends[i].encrypt_bytes = b[STAT_ENCRYPT_BYTES];
+        backends[i].ns = b[STAT_NS];
+    }
+    return backend_count;
+}
+
+void xtsn_reset_stats(void) {
+    stats_registry().Reset();
+}
+
+//64 bytes are or'ed together per step and checked once, so a sector with data usually stops at its first step
+static bool all_zero(const u8 *p, size_t len) {
+    size_t i = 0;
+    #if defined ZERO_SSE2
+    for(; i + 64 <= len; i += 64) {
+        __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + i)), _mm_loadu_si128((const __m128i*)(p + i + 16)));
+        __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + i + 32)), _mm_loadu_si128((const __m128i*)(p + i + 48)));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(a, b), _mm_setzero_si128())) != 0xFFFF) return false;
+    }
+    #elif defined ZERO_NEON
+    for(; i + 64 <= len; i += 64) {
+        uint8x16_t a = vorrq_u8(vld1q_u8(p + i), vld1q_u8(p + i + 16));
+        uint8x16_t b = vorrq_u8(vld1q_u8(p + i + 32), vld1q_u8(p + i + 48));
+        if(vmaxvq_u8(vorrq_u8(a, b))) return false;
+    }
+    #endif
+    for(; i + 8 <= len; i += 8) {
+        u64 word;
+        memcpy(&word, p + i, 8);
+        if(word) return false;
+    }
+    for(; i < len; i++) {
+        if(p[i]) return false;
+    }
+    return true;
+}
+
+int xtsn_zero_map(const void *buf, size_t len, size_t sector_size, uint8_t *map, size_t *used) {
+    if(!sector_size) return XTSN_ERR_SECTOR_SIZE_ZERO;
+    const u8 *p = (const u8*)buf;
+    size_t sectors = len / sector_size + (len % sector_size != 0), count = 0;
+    if(map) memset(map, 0, (sectors + 7) / 8);
+    for(size_t i = 0; i < sectors; i++) {
+        size_t start = i * sector_size;
+        if(!all_zero(p + start, len - start < sector_size ? len - start : sector_size)) {
+            if(map) map[i / 8] |= (u8)(1 << (i % 8));
+            count++;
+        }
+    }
+    if(used) *used = count;
+    return XTSN_OK;
+}
+
+const char *xtsn_strerror(int err) {
+    switch(err) {
+        case XTSN_OK: return "no error";
+        case XTSN_ERR_LENGTH: return "length not divisable by 16";
+        case XTSN_ERR_SKIPPED: return "skipped bytes not divisable by 16";
+        case XTSN_ERR_SECTOR_SIZE_ZERO: return "sector size must not be 0";
+        case XTSN_ERR_SECTOR_SIZE: return "sector size not divisable by 16";
+        case XTSN_ERR_THREADS: return "threads must be at least 1";
+        case XTSN_ERR_NOMEM: return "out of memory";
+        case XTSN_ERR_BACKEND: return "unexpected error from the backend";
+        case XTSN_ERR_UNKNOWN_BACKEND: return "unknown backend";
+        case XTSN_ERR_UNAVAILABLE: return "backend not available on this system";
+        case XTSN_ERR_IO: return "I/O error";
+        case XTSN_ERR_INVALID_ARG: return "invalid argument";
+        default: return "unknown error";
+    }
+}
+
+} //extern
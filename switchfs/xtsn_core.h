@@ -0,0 +1,264 @@
+/*
+ * Nintendo AES-XTSN (XTS with a big endian sector number as the tweak), independent of Python.
+ *
+ * xtsn_init picks a default backend: VAES, AES-NI or the ARMv8 instructions when the CPU has them,
+ * otherwise OpenSSL's libcrypto when it can be loaded, otherwise the portable T-table code. Any
+ * other available one can be selected for everything, or for one context. Large buffers are split
+ * on sector boundaries between worker threads.
+ *
+ * All functions return XTSN_OK or one of the errors below, unless noted.
+ */
+#ifndef XTSN_CORE_H
+#define XTSN_CORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {
+    XTSN_OK = 0,
+    XTSN_ERR_LENGTH,            //length not a multiple of 16
+    XTSN_ERR_SKIPPED,           //skipped bytes not a multiple of 16
+    XTSN_ERR_SECTOR_SIZE_ZERO,
+    XTSN_ERR_SECTOR_SIZE,       //sector size not a multiple of 16
+    XTSN_ERR_THREADS,           //thread count out of range
+    XTSN_ERR_NOMEM,
+    XTSN_ERR_BACKEND,           //the backend failed, like openssl returning an error
+    XTSN_ERR_UNKNOWN_BACKEND,   //no backend by that name in this build
+    XTSN_ERR_UNAVAILABLE,       //the CPU or system can't run that backend
+    XTSN_ERR_IO,                //reading failed, errno has why
+    XTSN_ERR_INVALID_ARG,       //some other argument out of its range
+};
+
+//how an xtsn_reader reads
+enum {
+    XTSN_IO_AUTO = 0,           //io_uring where the kernel has it, pread otherwise
+    XTSN_IO_PREAD,              //one blocking positional read per call
+    XTSN_IO_URING,              //many reads in flight, each decrypted as soon as it completes. linux only
+};
+
+typedef struct xtsn_reader xtsn_reader;
+
+typedef struct xtsn_ctx xtsn_ctx;
+
+typedef struct {
+    const char *name;           //"vaes", "aes-ni", "armv8", "openssl", "constant-time" or "portable"
+    const char *simd;           //instruction set extensions used, "" for plain C
+    int vector_bits;            //width of the registers blocks are crypted in, 0 for scalar code
+    int parallel_blocks;        //blocks kept in flight at once, 0 if unknown
+    int batch_blocks;           //blocks handed to the block code per call
+    int constant_time;          //no secret dependent memory accesses
+    int available;              //can be selected on this system
+} xtsn_backend_info;
+
+//counters kept since the start or the last xtsn_reset_stats. they're always on and only cost two
+//clock reads and a few adds to per thread counters per call. calls still running aren't in them yet
+typedef struct {
+    uint64_t tweak_aes;         //sector tweaks encrypted
+    uint64_t tweak_cache_hits;  //first tweaks of a run found in the context's tweak cache instead
+    uint64_t seek_blocks;       //blocks the first tweak of a run was skipped ahead by
+    uint64_t runs;              //calls or, for split calls, parts of them crypted by one thread
+    uint64_t run_ns;            //time spent in those, added up over threads
+    uint64_t split_calls;       //calls spread over more than one thread
+    uint64_t errors;            //calls that failed
+} xtsn_stats;
+
+typedef struct {
+    uint64_t decrypt_calls;
+    uint64_t decrypt_bytes;
+    uint64_t encrypt_calls;
+    uint64_t encrypt_bytes;
+    uint64_t ns;                //wall time spent crypting in the calls, both directions
+} xtsn_backend_stats;
+
+/**
+ * @purpose:            Pick the backend. Safe to call more than once, later calls do nothing
+ *                      until xtsn_cleanup. xtsn_new calls it when needed
+ */
+void xtsn_init(void);
+
+/**
+ * @purpose:            Unload libcrypto if it was loaded and go back to the portable code.
+ *                      No context may be used with openssl afterwards
+ */
+void xtsn_cleanup(void);
+
+/**
+ * @purpose:            List the backends in this build, fastest first. Checking if openssl is
+ *                      available loads libcrypto
+ * @par[out]out:        up to max entries, may be NULL when max is 0
+ * @par[in]max:         size of out
+ * @return:             how many backends there are, which may be more than max
+ */
+int xtsn_backends(xtsn_backend_info *out, int max);
+
+/**
+ * @purpose:            Select the backend contexts use unless they have one of their own
+ * @par[in]name:        a backend name, or NULL for the default from xtsn_init
+ */
+int xtsn_set_backend(const char *name);
+
+/**
+ * @purpose:            Name of the backend contexts use unless they have one of their own
+ * @return:             a static string
+ */
+const char *xtsn_backend(void);
+
+/**
+ * @purpose:            Without AES instructions, make the bitsliced AES the default instead of
+ *                      table lookups or OpenSSL (or go back to those)
+ * @par[in]enable:      non-zero to use it
+ */
+void xtsn_set_constant_time(int enable);
+
+/**
+ * @purpose:            Check if crypting with the default backend runs without secret dependent memory accesses
+ * @return:             non-zero if it does
+ */
+int xtsn_get_constant_time(void);
+
+/**
+ * @purpose:            Set how many threads large buffers are split between by default
+ * @par[in]threads:     at least 1
+ */
+int xtsn_set_threads(int threads);
+
+/**
+ * @purpose:            Get how many threads large buffers are split between by default
+ * @return:             the thread count
+ */
+int xtsn_get_threads(void);
+
+/**
+ * @purpose:            Make a context for one pair of keys. It may be used from several threads at once
+ * @par[in]key:         16 bytes, the data key
+ * @par[in]tweak:       16 bytes, the tweak key
+ * @par[out]ctx:        the new context, to be freed with xtsn_free
+ */
+int xtsn_new(const uint8_t *key, const uint8_t *tweak, xtsn_ctx **ctx);
+
+/**
+ * @purpose:            Select the backend for one context. Calls already running finish with the old one
+ * @par[in]ctx:         the context
+ * @par[in]name:        a backend name, or NULL to use the one from xtsn_set_backend
+ */
+int xtsn_ctx_set_backend(xtsn_ctx *ctx, const char *name);
+
+/**
+ * @purpose:            Name of the backend a context uses
+ * @par[in]ctx:         the context
+ * @return:             a static string
+ */
+const char *xtsn_ctx_backend(xtsn_ctx *ctx);
+
+/**
+ * @purpose:            Free a context from xtsn_new. NULL is ignored
+ * @par[in]ctx:         the context
+ */
+void xtsn_free(xtsn_ctx *ctx);
+
+/**
+ * @purpose:                Decrypt len bytes of a sector range
+ * @par[in]ctx:             the context
+ * @par[out]out:            len bytes
+ * @par[in]in:              len bytes, may be out or overlap it. NULL to decrypt out in place
+ * @par[in]len:             length, a multiple of 16
+ * @par[in]sector_lo:       low 64 bits of the number of the sector the data starts in
+ * @par[in]sector_hi:       high 64 bits of it
+ * @par[in]sector_size:     sector size, a multiple of 16
+ * @par[in]skipped_bytes:   where the data starts past the start of that sector, a multiple of 16
+ * @par[in]threads:         most threads to split between, 0 for the default
+ */
+int xtsn_decrypt(xtsn_ctx *ctx, void *out, const void *in, size_t len, uint64_t sector_lo, uint64_t sector_hi,
+                 uint64_t sector_size, uint64_t skipped_bytes, int threads);
+
+/**
+ * @purpose:                Encrypt len bytes of a sector range, see xtsn_decrypt
+ */
+int xtsn_encrypt(xtsn_ctx *ctx, void *out, const void *in, size_t len, uint64_t sector_lo, uint64_t sector_hi,
+                 uint64_t sector_size, uint64_t skipped_bytes, int threads);
+
+/**
+ * @purpose:            Read the counters
+ * @par[out]stats:      the totals, may be NULL
+ * @par[out]backends:   up to max per backend counters, in the same order as xtsn_backends
+ * @par[in]max:         size of backends
+ * @return:             how many backends there are, which may be more than max
+ */
+int xtsn_get_stats(xtsn_stats *stats, xtsn_backend_stats *backends, int max);
+
+/**
+ * @purpose:            Set all counters back to zero
+ */
+void xtsn_reset_stats(void);
+
+/**
+ * @purpose:            Make a reader for a file, like an encrypted image. It may be used from several threads
+ *                      at once, and doesn't close or take over fd
+ * @par[in]fd:          the file, opened for reading
+ * @par[in]engine:      one of the XTSN_IO values, XTSN_ERR_UNAVAILABLE if it can't be used here
+ *                      and XTSN_ERR_INVALID_ARG if it's none of them
+ * @par[in]depth:       most reads one call keeps in flight with io_uring, 0 for the default,
+ *                      XTSN_ERR_INVALID_ARG if negative
+ * @par[out]reader:     the new reader, to be freed with xtsn_reader_free
+ */
+int xtsn_reader_new(int fd, int engine, int depth, xtsn_reader **reader);
+
+/**
+ * @purpose:            Name of the engine a reader ended up with
+ * @par[in]reader:      the reader
+ * @return:             "io_uring" or "pread", a static string
+ */
+const char *xtsn_reader_engine(xtsn_reader *reader);
+
+/**
+ * @purpose:                Read len bytes at offset into buf and decrypt them in place. With io_uring the read is
+ *                          split up and every piece is decrypted as it arrives, while the rest are still being read
+ * @par[in]reader:          the reader
+ * @par[in]ctx:             the keys, or NULL to only read
+ * @par[out]buf:            len bytes
+ * @par[in]len:             length
+ * @par[in]offset:          where in the file to read from
+ * @par[in]sector_lo:       low 64 bits of the number of the sector the data starts in, see xtsn_decrypt
+ * @par[in]sector_hi:       high 64 bits of it
+ * @par[in]sector_size:     sector size, a multiple of 16
+ * @par[in]skipped_bytes:   where the data starts past the start of that sector, a multiple of 16
+ * @par[out]got:            bytes read, less than len at the end of the file. with ctx, rounded down to a
+ *                          multiple of 16, which is what was decrypted
+ */
+int xtsn_read_decrypt(xtsn_reader *reader, xtsn_ctx *ctx, void *buf, size_t len, uint64_t offset,
+                      uint64_t sector_lo, uint64_t sector_hi, uint64_t sector_size, uint64_t skipped_bytes,
+                      size_t *got);
+
+/**
+ * @purpose:            Free a reader from xtsn_reader_new. NULL is ignored
+ * @par[in]reader:      the reader
+ */
+void xtsn_reader_free(xtsn_reader *reader);
+
+/**
+ * @purpose:            Find the sectors of a buffer that are all zero, like unused space in a decrypted partition
+ * @par[in]buf:         len bytes
+ * @par[in]len:         length, the last sector may be shorter than sector_size
+ * @par[in]sector_size: size of each sector, must not be 0
+ * @par[out]map:        bit i (lowest bit first) set if sector i has a non-zero byte, (sectors + 7) / 8 bytes.
+ *                      may be NULL
+ * @par[out]used:       how many sectors have a non-zero byte, may be NULL
+ */
+int xtsn_zero_map(const void *buf, size_t len, size_t sector_size, uint8_t *map, size_t *used);
+
+/**
+ * @purpose:            Describe an error
+ * @par[in]err:         one of the XTSN_ERR values
+ * @return:             a static string
+ */
+const char *xtsn_strerror(int err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif